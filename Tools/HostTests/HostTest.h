@@ -0,0 +1,36 @@
+#ifndef _HOSTTEST_
+#define _HOSTTEST_
+
+//Just enough of a test framework for the firmware headers
+//  CHECK() reports a failure and carries on, main() returns failures() so make sees it.
+
+#include <stdio.h>
+
+inline int &hostTestFailures(){
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition) do{ \
+        if(!(condition)){ \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            hostTestFailures()++; \
+        } \
+    } while(0)
+
+#define CHECK_EQ(actual, expected) do{ \
+        long long a_ = (long long)(actual); \
+        long long e_ = (long long)(expected); \
+        if(a_ != e_){ \
+            printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_); \
+            hostTestFailures()++; \
+        } \
+    } while(0)
+
+//Print the result and give main() its exit code
+inline int finish(const char *name){
+    printf("%s: %s\n", name, hostTestFailures() ? "FAILED" : "passed");
+    return hostTestFailures() ? 1 : 0;
+}
+
+#endif  //_HOSTTEST_
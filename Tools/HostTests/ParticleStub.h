@@ -0,0 +1,232 @@
+#ifndef _PARTICLESTUB_
+#define _PARTICLESTUB_
+
+//The parts of Device OS the tested headers use, driven by the test
+//  Time only moves when the test calls advance(), and a Timer only fires from there,
+//  so a test decides exactly when the timer thread "runs". A Thread is a real thread,
+//  its delay() just yields, only the test's own thread moves time.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+//Like Device OS, the result is the wider of the two
+template <typename A, typename B>
+auto min(A a, B b) -> decltype(a + b){
+    return a < b ? a : b;
+}
+
+template <typename A, typename B>
+auto max(A a, B b) -> decltype(a + b){
+    return a > b ? a : b;
+}
+
+inline std::atomic<uint32_t> &stubMillis(){
+    static std::atomic<uint32_t> now(0);
+    return now;
+}
+
+inline const std::thread::id stubMainThread = std::this_thread::get_id();
+
+inline bool isStubMainThread(){
+    return std::this_thread::get_id() == stubMainThread;
+}
+
+inline uint32_t millis(){
+    return stubMillis();
+}
+
+#define SINGLE_THREADED_BLOCK()
+
+//Software timer - fires from advance(), in the order they were started
+class Timer;
+
+inline std::vector<Timer *> &stubTimers(){
+    static std::vector<Timer *> timers;
+    return timers;
+}
+
+class Timer {
+    std::function<void()> _callback;
+    unsigned int _period;
+    unsigned int _lastFired;
+    bool _isActive;
+
+    public:
+
+        Timer(unsigned int period, void (*callback)()): _callback(callback){
+            _period = period;
+            _lastFired = 0;
+            _isActive = false;
+        }
+
+        template <typename T>
+        Timer(unsigned int period, void (T::*callback)(), T &instance){
+            T *object = &instance;
+            _callback = [object, callback]{ (object->*callback)(); };
+            _period = period;
+            _lastFired = 0;
+            _isActive = false;
+        }
+
+        ~Timer(){
+            auto &timers = stubTimers();
+            timers.erase(std::remove(timers.begin(), timers.end(), this), timers.end());
+        }
+
+        void start(){
+            if(!_isActive){
+                stubTimers().push_back(this);
+            }
+            _isActive = true;
+            _lastFired = millis();
+        }
+
+        void stop(){
+            auto &timers = stubTimers();
+            timers.erase(std::remove(timers.begin(), timers.end(), this), timers.end());
+            _isActive = false;
+        }
+
+        void changePeriod(unsigned int period){
+            _period = period;
+            start();
+        }
+
+        bool isActive(){
+            return _isActive;
+        }
+
+        //Fire if a period has gone by since the last time
+        void poll(){
+            if(_isActive && millis() - _lastFired >= _period){
+                _lastFired = _lastFired + _period;
+                _callback();
+            }
+        }
+};
+
+//Move time on a ms at a time, firing timers as they come due
+inline void advance(uint32_t ms){
+    for(uint32_t i=0; i<ms; i++){
+        stubMillis()++;
+        std::vector<Timer *> timers = stubTimers();
+        for(Timer *timer : timers){
+            timer->poll();
+        }
+    }
+}
+
+//The test's thread waits in stub time, any other thread just lets the test run
+inline void delay(uint32_t ms){
+    if(isStubMainThread()){
+        advance(ms);
+    } else{
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+typedef void os_thread_return_t;
+
+class Thread {
+    public:
+
+        Thread(){
+        }
+
+        Thread(const char *name, os_thread_return_t (*function)(void *), void *param){
+            std::thread(function, param).detach();
+        }
+};
+
+struct StubWatchdog{
+    unsigned long refreshes = 0;
+    void refresh(){
+        refreshes++;
+    }
+};
+
+inline StubWatchdog &stubWatchdog(){
+    static StubWatchdog watchdog;
+    return watchdog;
+}
+#define Watchdog stubWatchdog()
+
+//PWM writes, newest last
+struct StubWrite{
+    uint32_t time;
+    int pin;
+    int value;
+};
+
+inline std::vector<StubWrite> &stubWrites(){
+    static std::vector<StubWrite> writes;
+    return writes;
+}
+
+inline void analogWrite(int pin, int value){
+    stubWrites().push_back({millis(), pin, value});
+}
+
+inline void digitalWrite(int pin, int value){
+    analogWrite(pin, value ? 255 : 0);
+}
+
+inline void pinMode(int, int){
+}
+
+//Emulated EEPROM, counting the writes that would wear the flash
+//  Setting writesLeft cuts the power after that many more bytes, the rest are lost.
+struct StubEEPROM{
+    uint8_t bytes[4096];
+    unsigned long writes = 0;
+    long writesLeft = -1;
+
+    StubEEPROM(){
+        memset(bytes, 0xFF, sizeof(bytes));
+    }
+    uint8_t read(int address){
+        return bytes[address];
+    }
+    void write(int address, uint8_t value){
+        if(writesLeft == 0){
+            return;
+        }
+        if(writesLeft > 0){
+            writesLeft--;
+        }
+        bytes[address] = value;
+        writes++;
+    }
+    template <typename T>
+    T &get(int address, T &value){
+        memcpy(&value, bytes + address, sizeof(T));
+        return value;
+    }
+    template <typename T>
+    const T &put(int address, const T &value){
+        const uint8_t *from = (const uint8_t *)&value;
+        for(size_t i=0; i<sizeof(T); i++){
+            write(address + i, from[i]);
+        }
+        return value;
+    }
+};
+
+inline StubEEPROM &stubEEPROM(){
+    static StubEEPROM eeprom;
+    return eeprom;
+}
+#define EEPROM stubEEPROM()
+
+const int OUTPUT = 1;
+const int LOW = 0;
+const int HIGH = 1;
+
+#endif  //_PARTICLESTUB_
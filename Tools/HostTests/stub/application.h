@@ -0,0 +1,50 @@
+#ifndef _STUB_APPLICATION_
+#define _STUB_APPLICATION_
+
+//What the Adafruit_MQTT library gets from Device OS, for host builds of it
+//  The network is spark_wiring_tcpclient.h's brokers, everything else is ParticleStub.h.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../ParticleStub.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+//On the Photon int32_t is a long, a different type from int, and the library overloads
+//  on both. wchar_t is the host's other signed 32 bit type, so wrapping still works.
+#define int32_t wchar_t
+
+#define F(x) (x)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define HEX 16
+#define DEC 10
+
+inline char *ltoa(long value, char *buf, int){
+    sprintf(buf, "%ld", value);
+    return buf;
+}
+
+inline char *ultoa(unsigned long value, char *buf, int){
+    sprintf(buf, "%lu", value);
+    return buf;
+}
+
+//Wall clock the test sets, invalid until it does
+struct StubTime{
+    long long seconds = 0;
+
+    bool isValid(){
+        return seconds > 0;
+    }
+    long long now(){
+        return seconds;
+    }
+};
+
+inline StubTime Time;
+
+#include "spark_wiring_usbserial.h"
+#include "spark_wiring_tcpclient.h"
+
+#endif  //_STUB_APPLICATION_
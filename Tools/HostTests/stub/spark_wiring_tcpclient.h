@@ -0,0 +1,205 @@
+#ifndef _STUB_TCPCLIENT_
+#define _STUB_TCPCLIENT_
+
+//A scripted network - brokers the test can take up and down, each a tiny MQTT broker
+//  A broker answers CONNECT, SUBSCRIBE and PINGREQ and keeps the topics and payloads
+//  published to it. A QoS 0 publish to a topic the client subscribed to comes back to it.
+//  Connecting to one that's down is a TCP timeout: STUB_TCP_TIMEOUT of stub time on the
+//  test's thread, STUB_TCP_TIMEOUT_REAL of real time on any other.
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <string>
+
+const uint32_t STUB_TCP_TIMEOUT = 5000;
+const uint32_t STUB_TCP_TIMEOUT_REAL = 200;
+
+class IPAddress {
+    uint8_t _a[4];
+
+    public:
+
+        IPAddress(){
+            memset(_a, 0, sizeof(_a));
+        }
+
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d){
+            _a[0] = a; _a[1] = b; _a[2] = c; _a[3] = d;
+        }
+
+        operator bool() const{
+            return _a[0] || _a[1] || _a[2] || _a[3];
+        }
+
+        bool operator==(const IPAddress &other) const{
+            return memcmp(_a, other._a, sizeof(_a)) == 0;
+        }
+
+        uint8_t operator[](int i) const{
+            return _a[i];
+        }
+};
+
+struct StubBroker{
+    const char *name;
+    IPAddress ip;
+    std::atomic<bool> isUp;
+    std::atomic<int> attempts;      //TCP connects tried, up or down
+    std::atomic<int> open;          //connections open now
+    std::mutex lock;
+    std::vector<std::string> published;
+    std::vector<std::string> payloads;
+
+    StubBroker(const char *n, IPAddress address, bool up): name(n), ip(address), isUp(up), attempts(0), open(0){
+    }
+};
+
+//Never freed, the probe thread can still be looking when main() returns
+inline std::vector<StubBroker *> &stubBrokers(){
+    static std::vector<StubBroker *> *brokers = new std::vector<StubBroker *>;
+    return *brokers;
+}
+
+inline StubBroker *addStubBroker(const char *name, IPAddress ip, bool isUp){
+    StubBroker *broker = new StubBroker(name, ip, isUp);
+    stubBrokers().push_back(broker);
+    return broker;
+}
+
+struct StubWiFi{
+    std::atomic<bool> isDnsUp{true};
+
+    IPAddress resolve(const char *name){
+        for(StubBroker *broker : stubBrokers()){
+            if(isDnsUp && strcmp(broker->name, name) == 0){
+                return broker->ip;
+            }
+        }
+        return IPAddress();
+    }
+};
+
+inline StubWiFi WiFi;
+
+class TCPClient {
+    StubBroker *_broker = NULL;
+    std::deque<uint8_t> _rx;
+    std::vector<std::string> _subscribed;
+
+    void reply(std::initializer_list<uint8_t> bytes){
+        _rx.insert(_rx.end(), bytes);
+    }
+
+    //One MQTT packet per write, the library sends each in one go
+    void handle(const uint8_t *buf, size_t len){
+        size_t at = 1;
+        uint32_t remaining = 0;
+        for(int shift=0; at < len; shift+=7){
+            remaining = remaining | (buf[at] & 0x7F) << shift;
+            if(!(buf[at++] & 0x80)){
+                break;
+            }
+        }
+        switch(buf[0] >> 4){
+            case 1:     //CONNECT
+                reply({0x20, 0x02, 0x00, 0x00});
+                break;
+            case 3:{    //PUBLISH
+                size_t topicLen = buf[at] << 8 | buf[at + 1];
+                std::lock_guard<std::mutex> guard(_broker->lock);
+                size_t payloadAt = at + 2 + topicLen + ((buf[0] & 0x06) ? 2 : 0);
+                _broker->published.push_back(std::string((const char *)buf + at + 2, topicLen));
+                _broker->payloads.push_back(std::string((const char *)buf + payloadAt, at + remaining - payloadAt));
+                std::string topic((const char *)buf + at + 2, topicLen);
+                if(!(buf[0] & 0x06) && std::find(_subscribed.begin(), _subscribed.end(), topic) != _subscribed.end()){
+                    _rx.insert(_rx.end(), buf, buf + len);
+                }
+                break;
+            }
+            case 8:{    //SUBSCRIBE, one topic at a time
+                size_t topicLen = buf[at + 2] << 8 | buf[at + 3];
+                _subscribed.push_back(std::string((const char *)buf + at + 4, topicLen));
+                reply({0x90, 0x03, buf[at], buf[at + 1], 0x00});
+                break;
+            }
+            case 12:    //PINGREQ
+                reply({0xD0, 0x00});
+                break;
+            case 14:    //DISCONNECT
+                stop();
+                break;
+        }
+    }
+
+    public:
+
+        ~TCPClient(){
+            stop();
+        }
+
+        int connect(IPAddress ip, uint16_t port){
+            stop();
+            for(StubBroker *broker : stubBrokers()){
+                if(broker->ip == ip){
+                    broker->attempts++;
+                    if(broker->isUp){
+                        _broker = broker;
+                        broker->open++;
+                        return 1;
+                    }
+                }
+            }
+            if(isStubMainThread()){
+                advance(STUB_TCP_TIMEOUT);
+            } else{
+                std::this_thread::sleep_for(std::chrono::milliseconds(STUB_TCP_TIMEOUT_REAL));
+            }
+            return 0;
+        }
+
+        int connect(const char *host, uint16_t port){
+            IPAddress ip = WiFi.resolve(host);
+            if(!ip){
+                return 0;
+            }
+            return connect(ip, port);
+        }
+
+        //A broker going down drops everyone on it
+        bool connected(){
+            return _broker != NULL && _broker->isUp;
+        }
+
+        int available(){
+            return connected() ? _rx.size() : 0;
+        }
+
+        int read(){
+            if(_rx.empty()){
+                return -1;
+            }
+            uint8_t c = _rx.front();
+            _rx.pop_front();
+            return c;
+        }
+
+        size_t write(const uint8_t *buf, size_t len){
+            if(!connected()){
+                return 0;
+            }
+            handle(buf, len);
+            return len;
+        }
+
+        void stop(){
+            if(_broker != NULL){
+                _broker->open--;
+                _broker = NULL;
+            }
+            _rx.clear();
+            _subscribed.clear();
+        }
+};
+
+#endif  //_STUB_TCPCLIENT_
@@ -0,0 +1,21 @@
+#ifndef _STUB_USBSERIAL_
+#define _STUB_USBSERIAL_
+
+//Library debug output goes nowhere
+struct StubSerial{
+    template <typename... Args>
+    size_t print(Args...){
+        return 0;
+    }
+    template <typename... Args>
+    size_t println(Args...){
+        return 0;
+    }
+    size_t write(uint8_t){
+        return 1;
+    }
+};
+
+inline StubSerial Serial;
+
+#endif  //_STUB_USBSERIAL_
@@ -0,0 +1,68 @@
+//Checks the charging LED's table (BreathingLED_DS.h) against the formula it replaced
+//  lightRedLED() used to work out 23*sin(2*pi*t/4)+28 on every pass of loop(), t in seconds.
+
+#include <math.h>
+#include "ParticleStub.h"
+#include "HostTest.h"
+#include "../../Vacuum_Status/src/BreathingLED_DS.h"
+
+const int PIN = 7;
+
+//The old level, t seconds into a breath
+int oldLevel(double t){
+    return 23 * sin(2 * M_PI * t / 4.0) + 28;
+}
+
+int writesTo(int pin){
+    int count = 0;
+    for(StubWrite &write : stubWrites()){
+        count = count + (write.pin == pin);
+    }
+    return count;
+}
+
+void testTable(){
+    BreathingLED led(PIN, 5, 51, 4000);
+    int worst = 0;
+
+    for(int i=0; i<BREATHE_STEPS; i++){
+        double t = 4.0 * i / BREATHE_STEPS;
+        worst = max(worst, abs(led.level(i) - oldLevel(t)));
+    }
+    CHECK_EQ(worst, 0);
+    CHECK_EQ(led.level(0), 28);
+    CHECK_EQ(led.level(BREATHE_STEPS / 4), 51);
+    CHECK_EQ(led.level(3 * BREATHE_STEPS / 4), 5);
+}
+
+//Timer steps follow the table, and a level that didn't change isn't written again
+void testWrites(){
+    BreathingLED led(PIN, 5, 51, 4000);
+    int step = 4000 / BREATHE_STEPS;
+
+    stubWrites().clear();
+    led.start();
+    advance(step * BREATHE_STEPS);
+    CHECK_EQ(writesTo(PIN), 54);
+    for(StubWrite &write : stubWrites()){
+        int i = (write.time - stubWrites()[0].time) / step;
+        CHECK_EQ(write.value, led.level(i));
+    }
+
+    //the next breath starts where the last left off, the first step is the same level
+    advance(step * BREATHE_STEPS);
+    CHECK_EQ(writesTo(PIN), 108);
+
+    led.stop();
+    CHECK_EQ(stubWrites().back().value, 0);
+    CHECK(!led.isOn());
+    int stopped = writesTo(PIN);
+    advance(1000);
+    CHECK_EQ(writesTo(PIN), stopped);
+}
+
+int main(){
+    testTable();
+    testWrites();
+    return finish("test_breathing_led");
+}
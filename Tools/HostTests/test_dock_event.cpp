@@ -0,0 +1,60 @@
+//Round trips the vacuumevents payload (DockEvent_DS.h) and checks what the ATM turns away
+
+#define SPARK
+#include "application.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/src/DockEvent_DS.h"
+
+bool unpack(const char *text, DockEvent *event){
+    return unpackDockEvent((const uint8_t *)text, strlen(text), event);
+}
+
+void testRoundTrip(){
+    DockEvent event = {1, 42, 1760870400123ULL};
+    DockEvent back;
+    char text[DOCK_EVENT_MAX_LEN + 1];
+
+    CHECK_EQ(packDockEvent(event, text), 18);
+    CHECK(strcmp(text, "1,42,1760870400123") == 0);
+    CHECK(unpack(text, &back));
+    CHECK_EQ(back.state, 1);
+    CHECK_EQ(back.seq, 42);
+    CHECK(back.timeMs == event.timeMs);
+
+    //the longest there is, Vacuum_Status checks DOCK_EVENT_MAX_LEN fits the outbox
+    DockEvent longest = {0, 0xFFFFFFFF, 9999999999999ULL};
+    CHECK_EQ(packDockEvent(longest, text), DOCK_EVENT_MAX_LEN);
+    CHECK(unpack(text, &back));
+    CHECK_EQ(back.seq, 0xFFFFFFFF);
+    CHECK(back.timeMs == longest.timeMs);
+
+    //before the cloud sets the clock
+    DockEvent early = {0, 7, 0};
+    packDockEvent(early, text);
+    CHECK(strcmp(text, "0,7,0") == 0);
+    CHECK(unpack(text, &back));
+    CHECK(back.timeMs == 0);
+}
+
+void testRejects(){
+    DockEvent event;
+    const uint8_t binary[13] = {1, 42, 0, 0, 0, 0x7B, 0xA3, 0x0E, 0xFF, 0x99, 0x01, 0, 0};
+
+    CHECK(!unpackDockEvent(binary, sizeof(binary), &event));     //the old 13 byte format
+    CHECK(!unpack("", &event));
+    CHECK(!unpack("1,42", &event));
+    CHECK(!unpack("1,42,", &event));
+    CHECK(!unpack(",42,100", &event));
+    CHECK(!unpack("2,42,100", &event));
+    CHECK(!unpack("1,42,100,5", &event));
+    CHECK(!unpack("1,4294967296,100", &event));
+    CHECK(!unpack("1,-4,100", &event));
+    CHECK(!unpack("1, 42,100", &event));
+    CHECK(!unpack("1,42,10000000000000000000000", &event));
+}
+
+int main(){
+    testRoundTrip();
+    testRejects();
+    return finish("test_dock_event");
+}
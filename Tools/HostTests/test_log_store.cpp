@@ -0,0 +1,115 @@
+//Checks the ATM's EEPROM log (LogStore_DS.h) across reboots, wraps and torn writes
+//  A reboot is a new LogStore on the same stub EEPROM. A torn write is the power going
+//  part way through a record, the EEPROM keeps the bytes written before it.
+
+#include "ParticleStub.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/src/LogStore_DS.h"
+
+const int START = 0x0200;
+const int LENGTH = 0x0600;
+const int SLOTS = LENGTH / LOG_RECORD_LEN;
+
+const int DUST = 0;
+const int LAST_VAC = 1;
+const int VAC_MS = 2;
+
+void wipe(){
+    memset(EEPROM.bytes, 0xFF, sizeof(EEPROM.bytes));
+    EEPROM.writesLeft = -1;
+}
+
+void write(LogStore &store, int key, uint32_t value){
+    store.set(key, value);
+    store.flush();
+}
+
+void testReboot(){
+    wipe();
+    LogStore store(START, LENGTH);
+    store.begin();
+    CHECK(!store.has(DUST));
+    write(store, DUST, 100);
+    write(store, LAST_VAC, 1700000000);
+    write(store, DUST, 250);
+
+    LogStore after(START, LENGTH);
+    after.begin();
+    CHECK(after.has(DUST));
+    CHECK_EQ(after.get(DUST), 250);
+    CHECK_EQ(after.get(LAST_VAC), 1700000000);
+    CHECK(!after.has(VAC_MS));
+    CHECK_EQ(after.badRecords(), 0);
+
+    //set() alone doesn't write
+    unsigned long writes = EEPROM.writes;
+    after.set(DUST, 300);
+    CHECK(after.isDirty());
+    CHECK_EQ(EEPROM.writes, writes);
+}
+
+//Round the region several times, the key that's set once stays readable
+void testWrap(){
+    wipe();
+    LogStore store(START, LENGTH);
+    store.begin();
+    write(store, LAST_VAC, 1700000000);
+    for(int i=1; i<=SLOTS * 3 + 7; i++){
+        write(store, DUST, i);
+        if(i % 50 == 0){
+            LogStore after(START, LENGTH);
+            after.begin();
+            CHECK_EQ(after.get(DUST), i);
+            CHECK_EQ(after.get(LAST_VAC), 1700000000);
+        }
+    }
+
+    //a reboot carries on from the newest record
+    LogStore after(START, LENGTH);
+    after.begin();
+    CHECK_EQ(after.get(DUST), SLOTS * 3 + 7);
+    write(after, DUST, 1);
+    LogStore again(START, LENGTH);
+    again.begin();
+    CHECK_EQ(again.get(DUST), 1);
+    CHECK_EQ(again.get(LAST_VAC), 1700000000);
+}
+
+//Power goes half way through every write for two turns of the region, whichever
+//slot the log has reached, a reboot still has every key
+void testTornWrites(){
+    wipe();
+    LogStore first(START, LENGTH);
+    first.begin();
+    write(first, LAST_VAC, 1700000000);
+    write(first, VAC_MS, 45000);
+
+    uint32_t dust = 0;
+    for(int i=0; i<SLOTS * 2; i++){
+        LogStore store(START, LENGTH);
+        store.begin();
+        CHECK_EQ(store.get(DUST), dust);
+        CHECK_EQ(store.get(LAST_VAC), 1700000000);
+        CHECK_EQ(store.get(VAC_MS), 45000);
+
+        EEPROM.writesLeft = LOG_RECORD_LEN / 2;
+        write(store, DUST, dust + 1000);     //lost
+        EEPROM.writesLeft = -1;
+
+        LogStore rebooted(START, LENGTH);
+        rebooted.begin();
+        CHECK_EQ(rebooted.get(DUST), dust);
+        CHECK_EQ(rebooted.get(LAST_VAC), 1700000000);
+        CHECK_EQ(rebooted.get(VAC_MS), 45000);
+        CHECK(rebooted.badRecords() <= 1);
+        dust++;
+        write(rebooted, DUST, dust);
+    }
+}
+
+int main(){
+    testReboot();
+    testWrap();
+    testTornWrites();
+    return finish("test_log_store");
+}
@@ -0,0 +1,85 @@
+//Round trips the Adafruit_MQTT library's binary payloads through a stub broker
+//  publishBinary<T>() on one side, setBinaryCallback<T>() and readBinary<T>() on the other.
+//  A payload that isn't sizeof(T) bytes must never reach the callback.
+
+#define SPARK
+#include "application.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT.cpp"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT_SPARK.cpp"
+
+StubBroker *broker = addStubBroker("io.adafruit.com", IPAddress(52, 1, 2, 3), true);
+
+int counts = 0;
+uint32_t lastCount = 0;
+int levels = 0;
+float lastLevel = 0;
+
+void onCount(uint32_t value){
+    counts++;
+    lastCount = value;
+}
+
+void onLevel(float value){
+    levels++;
+    lastLevel = value;
+}
+
+int main(){
+    TCPClient client;
+    Adafruit_MQTT_SPARK mqtt(&client, "io.adafruit.com", 1883, "user", "key");
+    Adafruit_MQTT_Publish countPub(&mqtt, "user/feeds/count");
+    Adafruit_MQTT_Publish levelPub(&mqtt, "user/feeds/level");
+    Adafruit_MQTT_Subscribe countSub(&mqtt, "user/feeds/count");
+    Adafruit_MQTT_Subscribe levelSub(&mqtt, "user/feeds/level");
+    countSub.setBinaryCallback<uint32_t>(onCount);
+    CHECK(mqtt.subscribe(&countSub));
+    CHECK(mqtt.subscribe(&levelSub));
+    CHECK_EQ(mqtt.connect(), 0);
+
+    //little-endian on the wire, whatever the value
+    CHECK(countPub.publishBinary<uint32_t>(0x12345678));
+    CHECK(broker->payloads.back() == std::string("\x78\x56\x34\x12", 4));
+    mqtt.processPackets(10);
+    CHECK_EQ(counts, 1);
+    CHECK_EQ(lastCount, 0x12345678);
+
+    CHECK(countPub.publishBinary<uint32_t>(0xFFFFFFFF));
+    mqtt.processPackets(10);
+    CHECK_EQ(counts, 2);
+    CHECK_EQ(lastCount, 0xFFFFFFFF);
+
+    //the wrong size is dropped, text included
+    uint8_t shortPayload[2] = {1, 2};
+    CHECK(mqtt.publish("user/feeds/count", shortPayload, sizeof(shortPayload)));
+    CHECK(countPub.publish("12345"));
+    uint64_t wide = 7;
+    CHECK(countPub.publishBinary<uint64_t>(wide));
+    mqtt.processPackets(10);
+    CHECK_EQ(counts, 2);
+    CHECK_EQ(lastCount, 0xFFFFFFFF);
+
+    //readBinary() on the last message, no callback
+    CHECK(levelPub.publishBinary<float>(-3.25f));
+    CHECK(mqtt.readSubscription(10) == &levelSub);
+    float level = 0;
+    CHECK(levelSub.readBinary(&level));
+    CHECK(level == -3.25f);
+    uint16_t wrong = 99;
+    CHECK(!levelSub.readBinary(&wrong));
+    CHECK_EQ(wrong, 99);
+
+    CHECK(levelPub.publish("1.5"));
+    CHECK(mqtt.readSubscription(10) == &levelSub);
+    CHECK(!levelSub.readBinary(&level));
+    CHECK(level == -3.25f);
+
+    //and a callback on a float feed
+    levelSub.setBinaryCallback<float>(onLevel);
+    CHECK(levelPub.publishBinary<float>(0.5f));
+    mqtt.processPackets(10);
+    CHECK_EQ(levels, 1);
+    CHECK(lastLevel == 0.5f);
+
+    return finish("test_mqtt_binary");
+}
@@ -0,0 +1,97 @@
+//Runs the Adafruit_MQTT library against scripted brokers to check failover and failback
+//  The failback probe runs on its own thread. keepalive() mustn't wait for it, even when
+//  the broker it's trying doesn't answer and the probe sits in a TCP timeout.
+
+#define SPARK
+#include "application.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT.cpp"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT_SPARK.cpp"
+
+StubBroker *primary = addStubBroker("primary.lan", IPAddress(192, 168, 1, 5), false);
+StubBroker *fallback = addStubBroker("io.adafruit.com", IPAddress(52, 1, 2, 3), true);
+
+//Call keepalive() until done() or a real second goes by, returns the longest call in stub ms
+template <typename Done>
+uint32_t keepaliveUntil(Adafruit_MQTT_SPARK &mqtt, Done done){
+    uint32_t longest = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    while(!done() && std::chrono::steady_clock::now() - start < std::chrono::seconds(1)){
+        uint32_t before = millis();
+        mqtt.keepalive();
+        longest = max(longest, millis() - before);
+        advance(10);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return longest;
+}
+
+int main(){
+    //thread-owned, left for the probe thread
+    TCPClient *client = new TCPClient;
+    Adafruit_MQTT_SPARK &mqtt = *new Adafruit_MQTT_SPARK(client, "io.adafruit.com", 1883, "user", "key");
+    Adafruit_MQTT_Publish dust(&mqtt, "user/feeds/dust");
+
+    //the LAN broker is preferred but down, the first connect falls back to the cloud
+    CHECK(mqtt.addBroker("primary.lan", 1883, "", "", true));
+    CHECK_EQ(mqtt.connect(), 0);
+    CHECK_EQ(mqtt.brokerIndex(), 1);
+    CHECK_EQ(mqtt.failovers(), 1);
+    CHECK_EQ(primary->attempts, 1);
+    CHECK(dust.publish(12));
+    CHECK_EQ(fallback->published.size(), 1);
+
+    //no probe before the interval
+    advance(MQTT_FAILBACK_INTERVAL_MS / 2);
+    mqtt.keepalive();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK_EQ(primary->attempts, 1);
+
+    //primary still down, the probe times out on its thread and the loop carries on
+    advance(MQTT_FAILBACK_INTERVAL_MS / 2);
+    uint32_t before = millis();
+    auto start = std::chrono::steady_clock::now();
+    mqtt.keepalive();
+    CHECK(millis() - before <= MQTT_CLIENT_READINTERVAL_MS);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(STUB_TCP_TIMEOUT_REAL / 4));
+    uint32_t longest = keepaliveUntil(mqtt, []{ return primary->attempts == 2; });
+    CHECK_EQ(primary->attempts, 2);
+    CHECK(longest <= MQTT_CLIENT_READINTERVAL_MS);   //at most a poll for the ping reply
+    std::this_thread::sleep_for(std::chrono::milliseconds(STUB_TCP_TIMEOUT_REAL * 2));
+    mqtt.keepalive();
+    CHECK(mqtt.connected());
+    CHECK_EQ(mqtt.brokerIndex(), 1);
+    CHECK(dust.publish(13));
+    CHECK_EQ(fallback->published.size(), 2);
+
+    //primary is back, the next probe finds it and the session moves up
+    primary->isUp = true;
+    advance(MQTT_FAILBACK_INTERVAL_MS);
+    longest = keepaliveUntil(mqtt, [&]{ return mqtt.brokerIndex() == 0; });
+    CHECK(longest <= MQTT_CLIENT_READINTERVAL_MS);   //at most a poll for the ping reply
+    CHECK_EQ(mqtt.brokerIndex(), 0);
+    CHECK(!mqtt.connected());
+    CHECK_EQ(primary->open, 0);         //the probe didn't leave its socket open
+    CHECK_EQ(fallback->open, 0);
+    CHECK_EQ(mqtt.connect(), 0);
+    CHECK_EQ(primary->open, 1);
+    CHECK_EQ(mqtt.failovers(), 1);
+    CHECK(dust.publish(14));
+    CHECK_EQ(primary->published.size(), 1);
+
+    //on the preferred broker nothing is probed
+    int attempts = primary->attempts;
+    advance(MQTT_FAILBACK_INTERVAL_MS * 2);
+    keepaliveUntil(mqtt, []{ return false; });
+    CHECK_EQ(primary->attempts, attempts);
+
+    //the primary dies, the reconnect starts from it and falls back again
+    primary->isUp = false;
+    CHECK(!mqtt.connected());
+    CHECK_EQ(mqtt.connect(), 0);
+    CHECK_EQ(mqtt.brokerIndex(), 1);
+    CHECK_EQ(mqtt.failovers(), 2);
+
+    return finish("test_mqtt_failover");
+}
@@ -0,0 +1,66 @@
+//Checks how the Adafruit_MQTT library sends publishes too big for its buffer or its outbox
+//  Nothing bigger than MAXBUFFERSIZE may be built into the packet buffer, and a diagnostics
+//  line that can't fit an outbox slot goes straight out or is refused, it isn't a lost message.
+
+#define SPARK
+#include "application.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT.cpp"
+#include "../../Vacuum_ATM/lib/Adafruit_MQTT/src/Adafruit_MQTT_SPARK.cpp"
+
+StubBroker *broker = addStubBroker("io.adafruit.com", IPAddress(52, 1, 2, 3), true);
+
+const char *LOOP_TOPIC = "vacuumuser/feeds/diagnostics.vacuumatmloop";
+//what's left of the buffer for a QoS 0 payload on LOOP_TOPIC, the length needs 2 bytes
+const int LOOP_ROOM = MAXBUFFERSIZE - 3 - 2 - strlen(LOOP_TOPIC);
+
+std::string line(int len){
+    return std::string(len, 'x');
+}
+
+int main(){
+    TCPClient client;
+    Adafruit_MQTT_SPARK mqtt(&client, "io.adafruit.com", 1883, "user", "key");
+    Adafruit_MQTT_Publish dust(&mqtt, "vacuumuser/feeds/dust");
+    Adafruit_MQTT_Publish loop(&mqtt, LOOP_TOPIC);
+    loop.setLatestValue(true);
+    CHECK_EQ(mqtt.connect(), 0);
+
+    //fills the buffer exactly, then one byte too many
+    CHECK(loop.publish(line(LOOP_ROOM).c_str()));
+    CHECK_EQ(broker->payloads.size(), 1);
+    CHECK(broker->payloads.back() == line(LOOP_ROOM));
+    CHECK(!loop.publish(line(LOOP_ROOM + 1).c_str()));
+    CHECK(!loop.publish(line(224).c_str()));
+    CHECK_EQ(broker->payloads.size(), 1);
+    CHECK_EQ(mqtt.outboxDepth(), 0);
+    CHECK_EQ(mqtt.outboxDrops(), 0);
+    CHECK(mqtt.connected());
+    CHECK(dust.publish(5));     //the client is still in one piece
+    CHECK(broker->payloads.back() == "5");
+
+    //dust over its rate limit waits in the outbox, a diagnostics line still goes now
+    CHECK(dust.setRateLimit(60));
+    CHECK(dust.publish(6));
+    CHECK(!dust.publish(7));
+    CHECK_EQ(mqtt.outboxDepth(), 1);
+    CHECK(loop.publish(line(96).c_str()));
+    CHECK(broker->payloads.back() == line(96));
+    CHECK_EQ(mqtt.outboxDepth(), 1);
+    CHECK_EQ(mqtt.outboxDrops(), 0);
+
+    //offline it's refused, not queued and not counted
+    broker->isUp = false;
+    CHECK(!loop.publish(line(96).c_str()));
+    CHECK_EQ(mqtt.outboxDepth(), 1);
+    CHECK_EQ(mqtt.outboxDrops(), 0);
+
+    //and the dust that waited still goes out first after the reconnect
+    broker->isUp = true;
+    CHECK_EQ(mqtt.connect(), 0);
+    advance(1000);
+    CHECK(mqtt.flushOutbox());
+    CHECK(broker->payloads.back() == "7");
+
+    return finish("test_mqtt_publish");
+}
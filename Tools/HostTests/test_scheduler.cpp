@@ -0,0 +1,340 @@
+//Checks the ATM's timing wheel (Scheduler_DS.h), the IoTTimers on it (Timer_DS.h), and compares
+//it with the polled IoTTimers it replaced
+//  The comparison runs an hour of the ATM's loop both ways and prints what it measured,
+//  the checks only hold the scheduler to doing the old loop's work at least as promptly.
+
+#include <chrono>
+#include "ParticleStub.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/src/Scheduler_DS.h"
+#include "../../Vacuum_ATM/src/Timer_DS.h"
+
+int ticks = 0;
+int timeouts = 0;
+int lastEvent = -1;
+Scheduler *scheduler;
+int victim = SCHED_NONE;
+
+void onTick(){
+    ticks++;
+}
+
+void onTimeout(){
+    timeouts++;
+}
+
+void post(int event){
+    lastEvent = event;
+}
+
+void cancelVictim(){
+    scheduler->cancel(victim);
+}
+
+//Move time on and run the scheduler every step ms, like a loop that never blocks
+void runFor(Scheduler &s, unsigned int ms, unsigned int step = 10){
+    for(unsigned int i=0; i<ms; i+=step){
+        stubMillis() += step;
+        s.run();
+    }
+}
+
+void testPeriodic(){
+    Scheduler s;
+    ticks = 0;
+    s.begin();
+    s.every(1000, onTick);
+    runFor(s, 990);
+    CHECK_EQ(ticks, 0);
+    runFor(s, 10);
+    CHECK_EQ(ticks, 1);
+    runFor(s, 60000);
+    CHECK_EQ(ticks, 61);
+    CHECK_EQ(s.skipped(), 0);
+
+    //called late but not a whole period late, still keeps to its beat
+    ticks = 0;
+    runFor(s, 10000, 70);
+    CHECK_EQ(ticks, 10);
+}
+
+//After a stall a periodic task runs once and carries on from then, not once per missed period
+void testStall(){
+    Scheduler s;
+    ticks = 0;
+    s.begin();
+    s.every(1000, onTick);
+    s.after(25000, onTimeout);
+    runFor(s, 3000);
+    CHECK_EQ(ticks, 3);
+
+    stubMillis() += 30000;          //a blocking connect
+    s.run();
+    CHECK_EQ(ticks, 4);
+    CHECK_EQ(timeouts, 1);
+    CHECK_EQ(s.skipped(), 29);
+    CHECK_EQ(s.msUntilNext(5000), 1000);
+
+    runFor(s, 990);
+    CHECK_EQ(ticks, 4);
+    runFor(s, 10);
+    CHECK_EQ(ticks, 5);
+}
+
+//Ids of freed tasks don't reach whoever got the slot next
+void testStaleIds(){
+    Scheduler s;
+    s.begin();
+    int first = s.after(10, onTimeout);
+    runFor(s, 20);
+    CHECK(!s.isPending(first));
+
+    int second = s.after(100, post, 3);
+    CHECK_EQ(second & 0xFF, first & 0xFF);
+    s.cancel(first);
+    CHECK(s.isPending(second));
+    lastEvent = -1;
+    runFor(s, 100);
+    CHECK_EQ(lastEvent, 3);
+
+    //a callback cancels a task due in the same run, the newest in a slot runs first
+    scheduler = &s;
+    lastEvent = -1;
+    victim = s.after(50, post, 4);
+    s.after(50, cancelVictim);
+    runFor(s, 60);
+    CHECK_EQ(lastEvent, -1);
+    CHECK(!s.isPending(victim));
+}
+
+//millis() wraps after 49.7 days, the unsigned differences carry straight over it
+void testRollover(){
+    Scheduler s;
+    ticks = 0;
+    stubMillis() = 0xFFFFFFFF - 2500;
+    s.begin();
+    s.every(1000, onTick);
+    runFor(s, 10000);
+    CHECK_EQ(ticks, 10);
+    CHECK(stubMillis() < 10000);
+    CHECK_EQ(s.skipped(), 0);
+
+    //and a stall that spans it
+    Scheduler stalled;
+    ticks = 0;
+    stubMillis() = 0xFFFFFFFF - 1500;
+    stalled.begin();
+    stalled.every(1000, onTick);
+    int timeout = stalled.after(3000, post, 5);
+    lastEvent = -1;
+    runFor(stalled, 1000);
+    CHECK_EQ(ticks, 1);
+    stubMillis() += 5000;
+    stalled.run();
+    CHECK_EQ(lastEvent, 5);
+    CHECK(!stalled.isPending(timeout));
+    CHECK_EQ(ticks, 2);
+    CHECK_EQ(stalled.msUntilNext(2000), 1000);
+    stubMillis() = 0;
+}
+
+//Timers from the pool, by callback, by event and polled
+void testIoTTimer(){
+    Scheduler s;
+    IoTTimer flash(s);
+    IoTTimer timeout(s);
+    IoTTimer beat(s);
+    IoTTimer polled(s);
+    s.begin();
+    ticks = 0;
+    timeouts = 0;
+    lastEvent = -1;
+
+    flash.startTimer(100, onTimeout);
+    timeout.startTimer(2000, post, 7);
+    beat.startTimer(1000, onTick, true);
+    polled.startTimer(500);
+    CHECK(flash.isPending());
+    runFor(s, 100);
+    CHECK_EQ(timeouts, 1);
+    CHECK(!flash.isPending());
+    CHECK(flash.isFinished());
+    CHECK(!polled.isFinished());
+    runFor(s, 400);
+    CHECK(polled.isFinished());
+    CHECK(!polled.isPending());
+
+    //restarting moves it, stopping it after it went off is harmless
+    timeout.startTimer(2000, post, 7);
+    flash.stopTimer();
+    runFor(s, 1500);
+    CHECK_EQ(lastEvent, -1);
+    runFor(s, 500);
+    CHECK_EQ(lastEvent, 7);
+    CHECK_EQ(ticks, 2);
+    beat.stopTimer();
+    runFor(s, 3000);
+    CHECK_EQ(ticks, 2);
+
+    //a one-shot that went off doesn't stop whoever got its task in the pool next
+    IoTTimer once(s);
+    once.startTimer(10, onTimeout);
+    runFor(s, 10);
+    CHECK_EQ(timeouts, 2);
+    flash.startTimer(100, onTimeout);
+    once.stopTimer();
+    CHECK(flash.isPending());
+    runFor(s, 100);
+    CHECK_EQ(timeouts, 3);
+}
+
+//The ATM loop before the scheduler, as far as timing goes
+class PolledTimer {
+    unsigned int _timerStart, _timerTarget;
+
+    public:
+
+        void startTimer(unsigned int msec){
+            _timerStart = millis();
+            _timerTarget = msec;
+        }
+
+        bool isFinished(){
+            return((millis()-_timerStart) >= _timerTarget);
+        }
+};
+
+const unsigned int HOUR = 3600000;
+const unsigned int SESSION_EVERY = 600000;    //a vacuum session arms the 20 s state timer
+const unsigned int READ_WAIT = 100;            //readSubscription()'s wait
+const unsigned int PASS_MS = 3;                //the rest of a pass - connect check, ping, outbox
+
+struct LoopCount{
+    unsigned long passes;
+    unsigned long checks;       //timers looked at
+    unsigned long callbacks;
+    unsigned int worstTickLate; //ms past a second between ticks
+    double ns;                  //host time spent on timing per pass
+};
+
+volatile unsigned long work;    //keeps the callbacks from being optimised out
+unsigned int lastTick;
+unsigned int worstLate;
+
+//How much later than a second after the last one each tick came
+void atmTick(){
+    unsigned int late = millis() - lastTick - 1000;
+    worstLate = max(worstLate, late);
+    lastTick = millis();
+    work++;
+}
+
+void atmWork(){
+    work++;
+}
+
+LoopCount oldLoop(){
+    LoopCount count = {};
+    PolledTimer tickTimer, stateTimer;
+    unsigned int lastCheckpoint = 0, lastDiag = 0, lastSession = 0;
+    bool isStateArmed = false;
+
+    stubMillis() = 0;
+    lastTick = 0;
+    worstLate = 0;
+    tickTimer.startTimer(1000);
+    auto start = std::chrono::steady_clock::now();
+    while(millis() < HOUR){
+        count.passes++;
+        count.checks = count.checks + 5;
+        if(tickTimer.isFinished()){
+            tickTimer.startTimer(1000);
+            atmTick();
+            count.callbacks++;
+        }
+        if(isStateArmed && stateTimer.isFinished()){
+            isStateArmed = false;
+            atmWork();
+            count.callbacks++;
+        }
+        if(millis() - lastCheckpoint >= 1800000){
+            lastCheckpoint = millis();
+            atmWork();
+            count.callbacks++;
+        }
+        if(millis() - lastDiag >= 900000){
+            lastDiag = millis();
+            atmWork();
+            count.callbacks++;
+        }
+        if(millis() - lastSession >= SESSION_EVERY){
+            lastSession = millis();
+            stateTimer.startTimer(20000);
+            isStateArmed = true;
+        }
+        stubMillis() += READ_WAIT + PASS_MS;
+    }
+    auto spent = std::chrono::steady_clock::now() - start;
+    count.ns = std::chrono::duration<double, std::nano>(spent).count() / count.passes;
+    count.worstTickLate = worstLate;
+    return count;
+}
+
+LoopCount newLoop(){
+    LoopCount count = {};
+    Scheduler s;
+    unsigned int lastSession = 0;
+
+    stubMillis() = 0;
+    lastTick = 0;
+    worstLate = 0;
+    s.begin();
+    s.every(1000, atmTick);
+    s.every(1800000, atmWork);
+    s.every(900000, atmWork);
+    auto start = std::chrono::steady_clock::now();
+    while(millis() < HOUR){
+        count.passes++;
+        s.run();
+        if(millis() - lastSession >= SESSION_EVERY){
+            lastSession = millis();
+            s.after(20000, atmWork);
+        }
+        stubMillis() += max(s.msUntilNext(READ_WAIT), 1U) + PASS_MS;
+    }
+    auto spent = std::chrono::steady_clock::now() - start;
+    count.ns = std::chrono::duration<double, std::nano>(spent).count() / count.passes;
+    count.callbacks = s.fired();
+    count.checks = s.wakeups();
+    count.worstTickLate = worstLate;
+    stubMillis() = 0;
+    return count;
+}
+
+void compare(){
+    LoopCount before = oldLoop();
+    LoopCount after = newLoop();
+
+    printf("  an hour of the ATM loop, IoTTimers vs scheduler:\n");
+    printf("    loop passes       %8lu %8lu\n", before.passes, after.passes);
+    printf("    timer callbacks   %8lu %8lu\n", before.callbacks, after.callbacks);
+    printf("    timer checks      %8lu %8lu (scheduler: runs that fired something)\n", before.checks, after.checks);
+    printf("    tick late, worst  %5u ms %5u ms\n", before.worstTickLate, after.worstTickLate);
+    printf("    timing ns/pass    %8.1f %8.1f (host)\n", before.ns, after.ns);
+
+    //the old tick restarted from when it was seen and slipped, the scheduler keeps every beat
+    //without waking for anything but what's due
+    CHECK(after.callbacks >= before.callbacks);
+    CHECK(after.worstTickLate <= SCHED_TICK + PASS_MS);
+    CHECK(after.passes <= before.passes + after.checks);
+}
+
+int main(){
+    testPeriodic();
+    testStall();
+    testStaleIds();
+    testRollover();
+    testIoTTimer();
+    compare();
+    return finish("test_scheduler");
+}
@@ -0,0 +1,90 @@
+//Checks when Supervisor_DS.h feeds the watchdog and who gets the blame
+
+#include "ParticleStub.h"
+#include "HostTest.h"
+#include "../../Vacuum_ATM/src/Supervisor_DS.h"
+
+const char *missName = NULL;
+unsigned int missLateMs = 0;
+int missCalls = 0;
+
+void onMiss(const char *name, unsigned int lateMs){
+    missName = name;
+    missLateMs = lateMs;
+    missCalls++;
+}
+
+//Nothing registered yet, a hang in setup() must still end in a reset
+void testNoTasks(){
+    Supervisor supervisor;
+    unsigned long refreshes = Watchdog.refreshes;
+
+    supervisor.begin();
+    advance(10000);
+    CHECK_EQ(Watchdog.refreshes, refreshes);
+}
+
+void testMiss(){
+    Supervisor supervisor;
+    const char *name = "";
+    unsigned int lateMs = 0;
+
+    int network = supervisor.add("network", 120000);
+    int inputs = supervisor.add("inputs", 150000);
+    supervisor.onMiss(onMiss);
+    supervisor.begin();
+
+    //both beating, fed every second
+    unsigned long refreshes = Watchdog.refreshes;
+    for(int i=0; i<60; i++){
+        advance(1000);
+        supervisor.beat(network);
+        supervisor.beat(inputs);
+    }
+    CHECK_EQ(Watchdog.refreshes - refreshes, 60);
+    CHECK(!supervisor.takeMiss(&name, &lateMs));
+
+    //a connect stalls - network stops first, inputs is stuck behind it a little later
+    advance(5000);
+    supervisor.beat(inputs);
+    advance(116000);
+    CHECK_EQ(missCalls, 1);
+    CHECK(missName != NULL && strcmp(missName, "network") == 0);
+    CHECK(missLateMs > 120000);
+    CHECK(supervisor.takeMiss(&name, &lateMs));
+    CHECK(strcmp(name, "network") == 0);
+    CHECK(!supervisor.takeMiss(&name, &lateMs));     //only once
+
+    refreshes = Watchdog.refreshes;
+    advance(30000);
+    CHECK_EQ(Watchdog.refreshes, refreshes);
+    CHECK_EQ(missCalls, 1);                         //still the same miss
+    CHECK_EQ(supervisor.misses(network), 1);
+
+    //caught up again, feeding starts again
+    supervisor.beatAll();
+    advance(2000);
+    CHECK(Watchdog.refreshes > refreshes);
+}
+
+void testPause(){
+    Supervisor supervisor;
+    int task = supervisor.add("dock", 150000);
+
+    supervisor.begin();
+    supervisor.pause();
+    advance(300000);            //asleep, nothing beats
+    supervisor.resume();
+    unsigned long refreshes = Watchdog.refreshes;
+    advance(1000);
+    supervisor.beat(task);
+    CHECK_EQ(Watchdog.refreshes - refreshes, 1);
+    CHECK_EQ(supervisor.misses(task), 0);
+}
+
+int main(){
+    testNoTasks();
+    testMiss();
+    testPause();
+    return finish("test_supervisor");
+}
@@ -0,0 +1,171 @@
+//Drives the ATM's transition table (VacStates_DS.h) with event sequences
+//  The actions are stand-ins that write down what ran, so each test checks both the
+//  state it ends in and the actions on the way.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include "HostTest.h"
+#include "../../Vacuum_ATM/src/VacStates_DS.h"
+
+std::string ran;            //actions in the order they ran
+bool isDone = false;        //what isVacDone() says
+bool isVacuumOut = false;   //enterDirty() posts REMOVED when the vacuum is already out
+int timerMs = -1;           //armed state timeout, -1 when disarmed
+StateMachine *machine;
+
+void note(const char *action){
+    ran = ran + action + " ";
+}
+
+void enterNotDirty(){ note("enterNotDirty"); }
+void enterDirty(){
+    note("enterDirty");
+    if(isVacuumOut){
+        machine->postUrgent(VAC_EV_REMOVED);
+    }
+}
+void enterVacuuming(){ note("enterVacuuming"); armStateTimer(20000); }
+void enterRewardReady(){ note("enterRewardReady"); }
+void enterStoppedEarly(){ note("enterStoppedEarly"); armStateTimer(2000); }
+void enterTakeReward(){ note("enterTakeReward"); }
+void exitTakeReward(){ note("exitTakeReward"); }
+void showDustRing(){ note("showDustRing"); }
+void showVacProgress(){ note("showVacProgress"); }
+void updateVacProgress(){ note("updateVacProgress"); }
+bool isVacDone(){ return isDone; }
+void rewardEarned(){ note("rewardEarned"); }
+void stoppedEarly(){ note("stoppedEarly"); }
+void openDoor(){ note("openDoor"); }
+void armStateTimer(int msec){ timerMs = msec; }
+void disarmStateTimer(){ note("disarm"); timerMs = -1; }
+
+//Start m in state, with the entry action's notes cleared
+void reset(StateMachine &m, uint8_t state){
+    machine = &m;
+    isDone = false;
+    isVacuumOut = false;
+    timerMs = -1;
+    m.start(state);
+    ran = "";
+}
+
+void send(StateMachine &m, uint8_t event){
+    m.post(event);
+    m.dispatch();
+}
+
+void testFullSession(){
+    StateMachine m(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
+    reset(m, CHARGING_NOT_DIRTY);
+
+    send(m, VAC_EV_DIRTY);
+    CHECK_EQ(m.state(), CHARGING_YES_DIRTY);
+    send(m, VAC_EV_REMOVED);
+    CHECK_EQ(m.state(), NOW_VACUUM_NO_REWARD);
+    CHECK_EQ(timerMs, 20000);
+    send(m, VAC_EV_TICK);
+    send(m, VAC_EV_TIMEOUT);
+    CHECK_EQ(m.state(), NOW_VACUUM_REWARD_READY);
+    CHECK(ran == "enterDirty enterVacuuming updateVacProgress disarm enterRewardReady ");
+
+    ran = "";
+    isDone = true;
+    send(m, VAC_EV_RETURNED);
+    CHECK_EQ(m.state(), FINISHED_TAKE_REWARD);
+    send(m, VAC_EV_CAM_PRESSED);
+    CHECK_EQ(m.state(), FINISHED_TAKE_REWARD);
+    send(m, VAC_EV_CAM_RELEASED);
+    CHECK_EQ(m.state(), CHARGING_NOT_DIRTY);
+    CHECK(ran == "rewardEarned enterTakeReward openDoor exitTakeReward enterNotDirty ");
+}
+
+void testStoppedEarly(){
+    StateMachine m(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
+    reset(m, NOW_VACUUM_NO_REWARD);
+
+    send(m, VAC_EV_RETURNED);       //isVacDone() is false
+    CHECK_EQ(m.state(), STOPPED_EARLY);
+    CHECK(ran == "disarm stoppedEarly enterStoppedEarly ");
+    CHECK_EQ(timerMs, 2000);
+    send(m, VAC_EV_TIMEOUT);
+    CHECK_EQ(m.state(), CHARGING_YES_DIRTY);
+
+    //taking it straight back out carries on vacuuming
+    reset(m, STOPPED_EARLY);
+    send(m, VAC_EV_REMOVED);
+    CHECK_EQ(m.state(), NOW_VACUUM_NO_REWARD);
+
+    //reward ready, but not enough time by the guard
+    reset(m, NOW_VACUUM_REWARD_READY);
+    send(m, VAC_EV_RETURNED);
+    CHECK_EQ(m.state(), STOPPED_EARLY);
+}
+
+void testIgnoredEvents(){
+    StateMachine m(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
+    reset(m, CHARGING_NOT_DIRTY);
+
+    //not dirty yet, taking the vacuum out doesn't start a session
+    send(m, VAC_EV_REMOVED);
+    send(m, VAC_EV_RETURNED);
+    send(m, VAC_EV_TICK);
+    send(m, VAC_EV_CAM_PRESSED);
+    CHECK_EQ(m.state(), CHARGING_NOT_DIRTY);
+    CHECK(ran == "");
+    send(m, VAC_EV_DUST);
+    CHECK(ran == "showDustRing ");
+
+    //dust and dirty don't matter while vacuuming
+    reset(m, NOW_VACUUM_NO_REWARD);
+    send(m, VAC_EV_DUST);
+    send(m, VAC_EV_DIRTY);
+    CHECK_EQ(m.state(), NOW_VACUUM_NO_REWARD);
+    CHECK(ran == "");
+}
+
+void testActionPostsEvent(){
+    StateMachine m(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
+    reset(m, CHARGING_NOT_DIRTY);
+
+    //the vacuum was already out when the house got dirty, one dispatch gets it vacuuming
+    isVacuumOut = true;
+    send(m, VAC_EV_DIRTY);
+    CHECK_EQ(m.state(), NOW_VACUUM_NO_REWARD);
+}
+
+//A long block leaves a pile of ticks and dirty checks, a dock event mustn't be lost behind them
+void testBacklog(){
+    StateMachine m(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
+    reset(m, NOW_VACUUM_REWARD_READY);
+    isDone = true;
+
+    for(int i=0; i<120; i++){
+        m.postOnce(VAC_EV_TICK);
+        m.postOnce(VAC_EV_DIRTY);
+    }
+    CHECK_EQ(m.droppedEvents(), 0);
+    for(int i=0; i<STATE_EVENT_QUEUE; i++){
+        m.post(VAC_EV_CAM_PRESSED);
+    }
+    CHECK(m.droppedEvents() > 0);
+    unsigned long dropped = m.droppedEvents();
+    m.postUrgent(VAC_EV_RETURNED);
+    CHECK_EQ(m.droppedEvents(), dropped);
+    m.dispatch();
+    CHECK_EQ(m.state(), FINISHED_TAKE_REWARD);
+
+    //the queue empties and takes normal events again
+    m.post(VAC_EV_CAM_RELEASED);
+    m.dispatch();
+    CHECK_EQ(m.state(), CHARGING_NOT_DIRTY);
+}
+
+int main(){
+    testFullSession();
+    testStoppedEarly();
+    testIgnoredEvents();
+    testActionPostsEvent();
+    testBacklog();
+    return finish("test_vac_states");
+}
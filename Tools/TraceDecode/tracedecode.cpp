@@ -0,0 +1,206 @@
+//Turns the binary log from DeferredLog_DS.h back into text
+//  Build:  g++ -O2 -o tracedecode tracedecode.cpp
+//  Run:    stty -F /dev/ttyACM0 raw && ./tracedecode /dev/ttyACM0
+//          ./tracedecode < capture.bin
+//
+//  Every line is stamped with the device's millis(). Bytes that aren't part of a good
+//  record (Device OS messages, anything printed straight to Serial) are passed through.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <map>
+
+const uint8_t TRACE_SYNC = 0x1E;
+const uint16_t TRACE_DEFINITION = 0x8000;
+
+std::map<int, std::string> formats;
+bool isLineStart = true;
+
+//Print text, stamping the start of each line
+void emit(const std::string &text, uint32_t time){
+    for(size_t i=0; i<text.size(); i++){
+        if(isLineStart){
+            printf("[%7u.%03u] ", time / 1000, time % 1000);
+            isLineStart = false;
+        }
+        putchar(text[i]);
+        if(text[i] == '\n'){
+            isLineStart = true;
+        }
+    }
+}
+
+struct Reader{
+    const uint8_t *p;
+    const uint8_t *end;
+
+    bool take(void *out, size_t n){
+        if(end - p < (long)n){
+            return false;
+        }
+        memcpy(out, p, n);
+        p = p + n;
+        return true;
+    }
+};
+
+//Formats one record's arguments the way the device's printf would have
+std::string format(const std::string &fmt, Reader args){
+    std::string out;
+    char buf[512];
+
+    for(size_t i=0; i<fmt.size(); i++){
+        if(fmt[i] != '%'){
+            out += fmt[i];
+            continue;
+        }
+        if(i + 1 < fmt.size() && fmt[i + 1] == '%'){
+            out += '%';
+            i++;
+            continue;
+        }
+        //%[flags][width][.precision][length]conversion, * takes an int argument
+        std::string spec = "%";
+        int longs = 0;
+        size_t j = i + 1;
+        for(; j < fmt.size() && strchr("-+ #0", fmt[j]); j++){
+            spec += fmt[j];
+        }
+        for(; j < fmt.size() && (isdigit(fmt[j]) || fmt[j] == '.' || fmt[j] == '*'); j++){
+            if(fmt[j] == '*'){
+                int32_t n = 0;
+                args.take(&n, 4);
+                spec += std::to_string(n);
+            } else{
+                spec += fmt[j];
+            }
+        }
+        for(; j < fmt.size() && strchr("hlzjtL", fmt[j]); j++){
+            longs = longs + (fmt[j] == 'l');
+        }
+        if(j >= fmt.size()){
+            break;
+        }
+        char conversion = fmt[j];
+        i = j;
+        buf[0] = 0;
+        if(strchr("diuxXoc", conversion)){
+            if(longs >= 2){
+                int64_t n = 0;
+                args.take(&n, 8);
+                snprintf(buf, sizeof(buf), (spec + "ll" + conversion).c_str(), (long long)n);
+            } else{
+                int32_t n = 0;
+                args.take(&n, 4);
+                if(conversion == 'd' || conversion == 'i' || conversion == 'c'){
+                    snprintf(buf, sizeof(buf), (spec + conversion).c_str(), (int)n);
+                } else{
+                    snprintf(buf, sizeof(buf), (spec + conversion).c_str(), (unsigned int)n);
+                }
+            }
+        } else if(strchr("fFeEgGaA", conversion)){
+            float f = 0;
+            args.take(&f, 4);
+            snprintf(buf, sizeof(buf), (spec + conversion).c_str(), (double)f);
+        } else if(conversion == 's'){
+            uint8_t len = 0;
+            char text[256];
+            args.take(&len, 1);
+            if(!args.take(text, len)){
+                len = 0;
+            }
+            text[len] = 0;
+            snprintf(buf, sizeof(buf), (spec + 's').c_str(), text);
+        } else if(conversion == 'p'){
+            uint32_t n = 0;
+            args.take(&n, 4);
+            snprintf(buf, sizeof(buf), "0x%08x", n);
+        } else{
+            snprintf(buf, sizeof(buf), "%%%c", conversion);
+        }
+        out += buf;
+    }
+    return out;
+}
+
+//A checked record's payload - a definition or a log line
+void handle(const uint8_t *payload, int len){
+    uint16_t id;
+    uint32_t time;
+
+    memcpy(&id, payload, 2);
+    if(id & TRACE_DEFINITION){
+        formats[id & ~TRACE_DEFINITION] = std::string((const char *)payload + 2, len - 2);
+        return;
+    }
+    if(len < 6){
+        return;
+    }
+    memcpy(&time, payload + 2, 4);
+    auto found = formats.find(id);
+    if(found == formats.end()){
+        emit("<format " + std::to_string(id) + " not seen yet>\n", time);
+        return;
+    }
+    Reader args = {payload + 6, payload + len};
+    emit(format(found->second, args), time);
+}
+
+uint8_t frame[258];
+int have = 0;       //bytes of a possible record collected so far, frame[0] is SYNC
+
+void feed(uint8_t c){
+    if(have == 0){
+        if(c == TRACE_SYNC){
+            frame[have++] = c;
+        } else{
+            putchar(c);     //plain text between records
+            isLineStart = c == '\n';
+        }
+        return;
+    }
+    frame[have++] = c;
+    if(have < 2 || have < frame[1] + 3){
+        return;
+    }
+    //whole frame: SYNC, length, payload, checksum
+    uint8_t sum = 0;
+    for(int i=1; i<have; i++){
+        sum = sum + frame[i];
+    }
+    if(sum == 0 && frame[1] >= 2){
+        handle(frame + 2, frame[1]);
+        have = 0;
+        return;
+    }
+    //not a record after all, pass the SYNC byte through and look again after it
+    uint8_t rest[258];
+    int count = have - 1;
+    memcpy(rest, frame + 1, count);
+    have = 0;
+    putchar(TRACE_SYNC);
+    for(int i=0; i<count; i++){
+        feed(rest[i]);
+    }
+}
+
+int main(int argc, char **argv){
+    FILE *in = stdin;
+    int c;
+
+    if(argc > 1){
+        in = fopen(argv[1], "rb");
+        if(!in){
+            perror(argv[1]);
+            return 1;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    while((c = fgetc(in)) != EOF){
+        feed(c);
+    }
+    return 0;
+}
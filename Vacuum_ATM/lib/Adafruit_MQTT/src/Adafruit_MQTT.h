@@ -100,6 +100,12 @@
 // Adjust as necessary, in seconds.  Default to 5 minutes.
 #define MQTT_CONN_KEEPALIVE 300
 
+// keepalive() pings once the link has been idle this much of the keepalive
+// interval, and gives up on the connection if the reply takes longer than
+// MQTT_PINGRESP_TIMEOUT_MS.
+#define MQTT_PING_IDLE_PCT 80
+#define MQTT_PINGRESP_TIMEOUT_MS 10000
+
 // Largest full packet we're able to send.
 // Need to be able to store at least ~90 chars for a connect packet with full
 // 23 char client ID.
@@ -120,8 +126,53 @@
 // eg max-subscription-payload-size
 #define SUBSCRIPTIONDATALEN 20
 
+// longest topic we can ask for the last value of, including the "/get"
+#define MQTT_GET_TOPICLEN 80
+
+// how many publish topics we want to be able to track, so the outbox can
+// tell which feeds coalesce and match stored messages back to them
+#define MAXPUBLISHERS 5
+
+// how many publishes the offline outbox holds before dropping the oldest
+#define MQTT_OUTBOX_DEPTH 8
+
+// largest payload the outbox will hold, longer publishes are not queued.
+// Stored it takes 2 + MQTT_OUTBOX_DEPTH*(4 + this) bytes, 242 at 26.
+#define MQTT_OUTBOX_PAYLOADLEN 26
+
+// while offline, how often a changed outbox is written to storage at most
+#define MQTT_OUTBOX_SAVE_MS 60000
+
+// Binary payloads for our own device-to-device feeds.  A value goes on the
+// wire as its fixed-width little-endian bytes, so nothing is formatted or
+// parsed.  Adafruit IO dashboards can't show these, keep text for them.
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  #error "Binary payloads assume a little-endian target"
+#endif
+
+// Write value at p and return the byte after it.
+template <typename T>
+inline uint8_t *mqttPutLE(uint8_t *p, T value) {
+  memcpy(p, &value, sizeof(T));
+  return p + sizeof(T);
+}
+
+// Read a value from p and return the byte after it.
+template <typename T>
+inline const uint8_t *mqttGetLE(const uint8_t *p, T *value) {
+  memcpy(value, p, sizeof(T));
+  return p + sizeof(T);
+}
+
 class AdafruitIO_Feed;  // forward decl
 
+// A received payload still sitting in the client's packet buffer.  Only valid
+// until the next read from the client, so use it inside the callback.
+struct Adafruit_MQTT_PayloadView {
+  const uint8_t *data;
+  uint16_t len;
+};
+
 //Function pointer that returns an int
 typedef void (*SubscribeCallbackUInt32Type)(uint32_t);
 // returns a double
@@ -130,11 +181,74 @@ typedef void (*SubscribeCallbackDoubleType)(double);
 typedef void (*SubscribeCallbackBufferType)(char *str, uint16_t len);
 // returns an io data wrapper instance
 typedef void (AdafruitIO_Feed::*SubscribeCallbackIOType)(char *str, uint16_t len);
+// returns a view into the receive buffer, nothing copied or truncated
+typedef void (*SubscribeCallbackViewType)(Adafruit_MQTT_PayloadView payload);
+// returns a binary value, see Adafruit_MQTT_Subscribe::setBinaryCallback()
+typedef void (*SubscribeCallbackBinaryType)();
+// decodes a binary payload and calls the callback, false on a size mismatch
+typedef bool (*SubscribeBinaryDecoderType)(SubscribeCallbackBinaryType callb, const uint8_t *data, uint16_t len);
 
 extern void printBuffer(uint8_t *buffer, uint16_t len);
 
 class Adafruit_MQTT_Subscribe;  // forward decl
 
+// Time spent in each phase of the most recent connect(), in milliseconds.
+// dns_ms is zero when the broker address came from the resolver cache.
+struct Adafruit_MQTT_ConnectTiming {
+  uint32_t dns_ms;
+  uint32_t tcp_ms;
+  uint32_t connack_ms;
+};
+
+// Token bucket used to keep publishes under the broker's rate limit.  A
+// per_minute of zero means unlimited.
+struct Adafruit_MQTT_RateLimit {
+  uint16_t per_minute;
+  uint8_t burst;
+  uint32_t micro_tokens;  // current fill, in millionths of a publish
+  uint32_t last_refill;
+};
+
+// Why the previous connection ended, counted per reconnect.
+#define MQTT_CAUSE_PEER   0  // found the socket closed
+#define MQTT_CAUSE_LOCAL  1  // disconnect() was called
+#define MQTT_CAUSE_PING   2  // a keepalive ping went unanswered
+#define MQTT_CAUSE_SEND   3  // a send failed
+#define MQTT_CAUSE_COUNT  4
+
+// Log2 histogram of durations in milliseconds: bins[i] counts samples from
+// 2^i up to 2^(i+1), bin 0 also takes 0 ms and the last bin is open ended.
+#define MQTT_HISTOGRAM_BINS 12
+struct Adafruit_MQTT_Histogram {
+  uint32_t count;
+  uint32_t max;
+  uint16_t bins[MQTT_HISTOGRAM_BINS];
+};
+
+// Counters kept by the client, see Adafruit_MQTT::metrics().  Packet counts
+// are indexed by control packet type (MQTT_CTRL_*).
+struct Adafruit_MQTT_Metrics {
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+  uint32_t packets_in[16];
+  uint32_t packets_out[16];
+  uint32_t dropped;     // read while waiting for another packet type
+  uint32_t truncated;   // cut to fit the packet buffer or lastread
+  uint32_t reconnects;
+  uint32_t reconnect_causes[MQTT_CAUSE_COUNT];
+  Adafruit_MQTT_Histogram connect_ms;
+  Adafruit_MQTT_Histogram ping_rtt_ms;
+  Adafruit_MQTT_Histogram puback_ms;
+};
+
+// One publish waiting in the offline outbox.
+struct Adafruit_MQTT_OutboxEntry {
+  const char *topic;
+  uint8_t qos;
+  uint8_t len;
+  uint8_t payload[MQTT_OUTBOX_PAYLOADLEN];
+};
+
 class Adafruit_MQTT {
  public:
   Adafruit_MQTT(const char *server,
@@ -181,10 +295,54 @@ class Adafruit_MQTT {
   bool will(const char *topic, const char *payload, uint8_t qos = 0, uint8_t retain = 0);
 
   // Publish a message to a topic using the specified QoS level.  Returns true
-  // if the message was published, false otherwise.
+  // if the message was published, false otherwise.  A message that can't be
+  // sent because we are disconnected is held in the outbox and replayed, in
+  // order, after the next successful connect().  A packet bigger than
+  // MAXBUFFERSIZE is refused, and a payload bigger than an outbox slot
+  // (MQTT_OUTBOX_PAYLOADLEN) is only ever sent straight away.
   bool publish(const char *topic, const char *payload, uint8_t qos = 0);
   bool publish(const char *topic, uint8_t *payload, uint16_t bLen, uint8_t qos = 0);
 
+  // Register a publish topic.  latest marks a feed that only carries its
+  // newest value, so queued publishes to it are coalesced into one.  Called
+  // by Adafruit_MQTT_Publish, returns false when there is no space left.
+  bool addPublishTopic(const char *topic, bool latest = false);
+
+  // Send whatever is waiting in the outbox.  Returns true once it is empty.
+  bool flushOutbox();
+
+  // Write the outbox to storage if it changed since the last time.  Called
+  // when the connection goes and from flushOutbox() while offline, call it
+  // before anything that loses RAM.  Storage is flash, so it isn't written
+  // for every publish.
+  void saveOutbox();
+
+  // Number of publishes waiting in the outbox, and how many were lost
+  // because it was full.
+  uint8_t outboxDepth() const { return outbox_count; }
+  uint32_t outboxDrops() const { return outbox_drops; }
+
+  // Limit publishes from this client to per_minute, allowing bursts of up to
+  // burst messages.  Publishes over the limit are deferred to the outbox and
+  // go out from flushOutbox() as the budget refills, so call flushOutbox()
+  // from the loop when a limit is set.
+  void setRateLimit(uint16_t per_minute, uint8_t burst = 1);
+  // The same, for a single registered publish topic.
+  bool setPublishRateLimit(const char *topic, uint16_t per_minute, uint8_t burst = 1);
+
+  // Subscribe to Adafruit IO's throttle and errors topics
+  // (username/throttle, username/errors).  A message on either halves our
+  // rate, which then creeps back up while things stay quiet, and throttle
+  // notices also pause publishing for as long as the broker asks.  Call
+  // before connect().
+  bool watchThrottle(Adafruit_MQTT_Subscribe *throttle, Adafruit_MQTT_Subscribe *errors = 0);
+
+  // How much of the client's publish budget is in use, 0-100.  100 means
+  // the next publish will be deferred.
+  uint8_t rateLimitUsage();
+  // True while the broker has told us to back off.
+  bool throttled() { return (int32_t)(rate_paused_until - millis()) > 0; }
+
   // Add a subscription to receive messages for a topic.  Returns true if the
   // subscription could be added or was already present, false otherwise.
   // Must be called before connect(), subscribing after the connection
@@ -205,6 +363,24 @@ class Adafruit_MQTT {
   // Ping the server to ensure the connection is still alive.
   bool ping(uint8_t n = 1);
 
+  // Keep the connection alive without blocking.  Call from the loop: sends a
+  // PINGREQ only once nothing has been sent or received for most of the
+  // keepalive interval, and never waits for the PINGRESP, which is matched
+  // whenever packets are read.  If no reply arrives the connection is
+  // treated as half-open and dropped, and false is returned.
+  bool keepalive();
+
+  // Round trip time of the last answered keepalive ping, in milliseconds.
+  uint32_t pingRTT() const { return ping_rtt_ms; }
+
+  // Copy out the connection metrics, totals since boot.  Copying leaves them
+  // counting, resetMetrics() starts them again from zero.
+  void metrics(Adafruit_MQTT_Metrics *snapshot) const { *snapshot = stats; }
+  void resetMetrics() { memset(&stats, 0, sizeof(stats)); }
+
+  // Phase breakdown of the last connect() attempt.
+  const Adafruit_MQTT_ConnectTiming &connectTiming() const { return connect_timing; }
+
  protected:
   // Interface that subclasses need to implement:
 
@@ -222,6 +398,19 @@ class Adafruit_MQTT {
   // milliseconds) for data to be available. 
   virtual uint16_t readPacket(uint8_t *buffer, uint16_t maxlen, int16_t timeout) = 0;
 
+  // Optional persistent storage for the outbox, addressed by byte offset.
+  // The default keeps the outbox in RAM only.
+  virtual bool storeOutbox(uint16_t offset, const uint8_t *data, uint16_t len) { return false; }
+  virtual bool loadOutbox(uint16_t offset, uint8_t *data, uint16_t len) { return false; }
+
+  // Called from keepalive() while connected, so a subclass can look after
+  // the link, e.g. move back to a preferred server.  It may disconnect, but
+  // mustn't wait on the network, keepalive() runs every pass of loop().
+  virtual void maintainServer() {}
+
+  // sendPacket() that keeps note of when we last sent something.
+  bool writePacket(uint8_t *buffer, uint16_t len);
+
   // Read a full packet, keeping note of the correct length
   uint16_t readFullPacket(uint8_t *buffer, uint16_t maxsize, uint16_t timeout);
   // Properly process packets until you get to one you want
@@ -239,15 +428,64 @@ class Adafruit_MQTT {
   uint8_t will_retain;
   uint8_t buffer[MAXBUFFERSIZE];  // one buffer, used for all incoming/outgoing
   uint16_t packet_id_counter;
+  Adafruit_MQTT_ConnectTiming connect_timing;
+  uint32_t last_send_ms;
+  uint32_t last_recv_ms;
+  bool ping_outstanding;
+  uint32_t ping_sent_ms;
+  uint32_t ping_rtt_ms;
+
+  Adafruit_MQTT_Metrics stats;
+  bool session_up;          // connected, as far as we know
+  bool session_seen;        // connected at least once since boot
+  uint8_t disconnect_cause;
+
+  // Note that the connection went away, the first cause seen wins.
+  void connectionLost(uint8_t cause);
 
  private:
   Adafruit_MQTT_Subscribe *subscriptions[MAXSUBSCRIPTIONS];
 
+  const char *publish_topics[MAXPUBLISHERS];
+  bool publish_latest[MAXPUBLISHERS];
+
+  Adafruit_MQTT_RateLimit publish_rate[MAXPUBLISHERS];
+
+  Adafruit_MQTT_RateLimit rate_limit;
+  uint8_t rate_scale;           // percent of the configured rate in use
+  uint32_t rate_paused_until;
+  uint32_t rate_last_backoff;
+  Adafruit_MQTT_Subscribe *throttle_sub;
+  Adafruit_MQTT_Subscribe *errors_sub;
+
+  Adafruit_MQTT_OutboxEntry outbox[MQTT_OUTBOX_DEPTH];
+  uint8_t outbox_head;
+  uint8_t outbox_count;
+  uint32_t outbox_drops;
+  bool outbox_restored;
+  bool outbox_dirty;            // changed since it was last stored
+  uint8_t outbox_stored;        // publishes in the stored copy
+  uint32_t outbox_saved_at;
+
   void    flushIncoming(uint16_t timeout);
 
+  // Send a publish packet right now, without going through the outbox.
+  bool sendPublish(const char *topic, uint8_t *payload, uint16_t bLen, uint8_t qos);
+
+  // Outbox bookkeeping.
+  bool queuePublish(const char *topic, uint8_t *payload, uint16_t bLen, uint8_t qos);
+  int8_t findPublishTopic(const char *topic);
+  void restoreOutbox();
+
+  // Rate limit bookkeeping.
+  void refillRate(Adafruit_MQTT_RateLimit *bucket);
+  bool takeRateToken(const char *topic);
+  void backOff(const char *msg, uint16_t len, uint16_t pause);
+
   // Functions to generate MQTT packets.
   uint8_t connectPacket(uint8_t *packet);
   uint8_t disconnectPacket(uint8_t *packet);
+  uint32_t publishPacketLen(const char *topic, uint16_t bLen, uint8_t qos);
   uint16_t publishPacket(uint8_t *packet, const char *topic, uint8_t *payload, uint16_t bLen, uint8_t qos);
   uint8_t subscribePacket(uint8_t *packet, const char *topic, uint8_t qos);
   uint8_t unsubscribePacket(uint8_t *packet, const char *topic);
@@ -268,6 +506,21 @@ class Adafruit_MQTT_Publish {
   bool publish(uint32_t i);
   bool publish(uint8_t *b, uint16_t bLen);
 
+  // Mark this feed as carrying only its latest value, so publishes queued
+  // while offline are coalesced instead of replayed one by one.
+  void setLatestValue(bool latest);
+
+  // Limit how often this feed publishes, see Adafruit_MQTT::setRateLimit().
+  bool setRateLimit(uint16_t per_minute, uint8_t burst = 1);
+
+  // Publish a number as raw little-endian bytes, e.g. publishBinary<uint32_t>(n).
+  // Only for feeds read by our own devices.
+  template <typename T>
+  bool publishBinary(T value) {
+    uint8_t payload[sizeof(T)];
+    mqttPutLE(payload, value);
+    return mqtt->publish(topic, payload, sizeof(T), qos);
+  }
 
 private:
   Adafruit_MQTT *mqtt;
@@ -283,12 +536,47 @@ class Adafruit_MQTT_Subscribe {
   void setCallback(SubscribeCallbackDoubleType callb);
   void setCallback(SubscribeCallbackBufferType callb);
   void setCallback(AdafruitIO_Feed *io, SubscribeCallbackIOType callb);
+  // View callbacks parse the payload in place: lastread is not cleared or
+  // filled and the payload isn't cut to SUBSCRIPTIONDATALEN.
+  void setCallback(SubscribeCallbackViewType callb);
   void removeCallback(void);
 
+  // Ask the broker for the feed's current value as soon as we're subscribed,
+  // by publishing to <topic>/get (the Adafruit IO convention).  The reply,
+  // like any retained message, arrives with is_retained set, so a restart
+  // learns the current state instead of waiting for the next change.
+  void fetchOnSubscribe(bool fetch) { fetch_last = fetch; }
+
+  // The last message received for this subscription, in the packet buffer.
+  // Valid until the next read from the client.
+  Adafruit_MQTT_PayloadView payload() const { return payload_view; }
+
+  // Call callb with the payload decoded as a binary T, as sent by
+  // Adafruit_MQTT_Publish::publishBinary<T>().  Payloads of the wrong size
+  // are dropped.
+  template <typename T>
+  void setBinaryCallback(void (*callb)(T)) {
+    callback_binary = (SubscribeCallbackBinaryType)callb;
+    binary_decoder = &decodeBinary<T>;
+  }
+
+  // Decode the last message as a binary T.  Returns false if its size doesn't
+  // match.  Like payload(), only valid until the next read from the client.
+  template <typename T>
+  bool readBinary(T *value) {
+    if (payload_view.len != sizeof(T))
+      return false;
+    mqttGetLE(payload_view.data, value);
+    return true;
+  }
+
   const char *topic;
   uint8_t qos;
 
   uint8_t lastread[SUBSCRIPTIONDATALEN];
+  // True when the last message is stored state (retained or fetched with
+  // fetchOnSubscribe()) rather than a live update.
+  bool is_retained;
   // Number valid bytes in lastread. Limited to SUBSCRIPTIONDATALEN-1 to
   // ensure nul terminating lastread.
   uint16_t datalen;
@@ -297,11 +585,29 @@ class Adafruit_MQTT_Subscribe {
   SubscribeCallbackDoubleType callback_double;
   SubscribeCallbackBufferType callback_buffer;
   SubscribeCallbackIOType     callback_io;
+  SubscribeCallbackViewType   callback_view;
+  SubscribeCallbackBinaryType callback_binary;
+  SubscribeBinaryDecoderType  binary_decoder;
 
   AdafruitIO_Feed *io_feed;
 
+  Adafruit_MQTT_PayloadView payload_view;
+
+  bool fetch_last;
+  bool fetch_pending;   // asked for the last value, reply not seen yet
+
  private:
   Adafruit_MQTT *mqtt;
+
+  template <typename T>
+  static bool decodeBinary(SubscribeCallbackBinaryType callb, const uint8_t *data, uint16_t len) {
+    T value;
+    if (len != sizeof(T))
+      return false;
+    mqttGetLE(data, &value);
+    ((void (*)(T))callb)(value);
+    return true;
+  }
 };
 
 
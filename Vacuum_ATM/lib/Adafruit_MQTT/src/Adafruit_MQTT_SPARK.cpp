@@ -50,15 +50,213 @@ bool Adafruit_MQTT_SPARK::Update()
     return true;
 }
 
-bool Adafruit_MQTT_SPARK::connectServer(){
-  // Grab server name from flash and copy to buffer for name resolution.
-  memset(buffer, 0, sizeof(buffer));
-  strcpy((char *)buffer, servername);
-  DEBUG_PRINT(F("Connecting to: ")); DEBUG_PRINTLN((char *)buffer);
+void Adafruit_MQTT_SPARK::initBrokers(const char *server, uint16_t port,
+                                      const char *user, const char *pass) {
+  for (uint8_t i=0; i<MQTT_MAX_BROKERS; i++)
+    brokers[i] = Adafruit_MQTT_Broker();
+  brokers[0].server = server;
+  brokers[0].port = port;
+  brokers[0].user = user;
+  brokers[0].pass = pass;
+  broker_count = 1;
+  broker_current = 0;
+  failover_count = 0;
+  failback_checked_at = 0;
+  probe_thread_started = false;
+  probe_state = MQTT_PROBE_IDLE;
+  probe_count = 0;
+  probe_found = -1;
+}
+
+bool Adafruit_MQTT_SPARK::addBroker(const char *server, uint16_t port,
+                                    const char *user, const char *pass,
+                                    bool preferred) {
+  if (broker_count >= MQTT_MAX_BROKERS)
+    return false;
+
+  uint8_t i = broker_count;
+  if (preferred) {
+    // Shuffle the rest down, the broker in use keeps being the same one.
+    for (i=broker_count; i>0; i--)
+      brokers[i] = brokers[i-1];
+    if (connected())
+      broker_current++;
+  }
+  brokers[i] = Adafruit_MQTT_Broker();
+  brokers[i].server = server;
+  brokers[i].port = port;
+  brokers[i].user = user;
+  brokers[i].pass = pass;
+  broker_count++;
+  if (!connected())
+    useBroker(0);
+  return true;
+}
+
+void Adafruit_MQTT_SPARK::flushDnsCache() {
+  for (uint8_t i=0; i<broker_count; i++)
+    brokers[i].ip_valid = false;
+}
+
+void Adafruit_MQTT_SPARK::useBroker(uint8_t i) {
+  if (i != broker_current) {
+    DEBUG_PRINT(F("Switching broker to ")); DEBUG_PRINTLN(brokers[i].server);
+  }
+  broker_current = i;
+  servername = brokers[i].server;
+  portnum = brokers[i].port;
+  username = brokers[i].user;
+  password = brokers[i].pass;
+}
+
+// Open a TCP connection to broker i on c, returns the client's connect()
+// result, non-zero on success.
+int Adafruit_MQTT_SPARK::openBroker(TCPClient *c, uint8_t i) {
+  Adafruit_MQTT_Broker *b = &brokers[i];
+  uint32_t start;
+  int r;
+
+  // Fast path: reuse the cached address while it is fresh, so a Wi-Fi flap
+  // only costs the TCP handshake and not another DNS round trip.
+  if (b->ip_valid && (millis() - b->ip_resolved_at) < MQTT_DNS_CACHE_TTL_MS) {
+    DEBUG_PRINTLN(F("Connecting to cached address"));
+    start = millis();
+    r = c->connect(b->ip, b->port);
+    connect_timing.tcp_ms += millis() - start;
+    if (r != 0)
+      return r;
+    // The broker may have moved; don't trust the cache again.
+    DEBUG_PRINTLN(F("Cached address failed, resolving again"));
+    b->ip_valid = false;
+  }
+
+  // Resolve by name, the packet buffer may still hold a subscriber's payload.
+  DEBUG_PRINT(F("Resolving: ")); DEBUG_PRINTLN(b->server);
+  start = millis();
+  IPAddress ip = WiFi.resolve(b->server);
+  connect_timing.dns_ms += millis() - start;
+
+  if (ip) {
+    b->ip = ip;
+    b->ip_valid = true;
+    b->ip_resolved_at = millis();
+  } else if (!b->ip_valid) {
+    // Nothing usable cached either, let the client try the name itself.
+    DEBUG_PRINTLN(F("Resolve failed"));
+    start = millis();
+    r = c->connect(b->server, b->port);
+    connect_timing.tcp_ms += millis() - start;
+    DEBUG_PRINT(F("Connect result: ")); DEBUG_PRINTLN(r);
+    return r;
+  } else {
+    // Keep using the expired entry while DNS is down; it was good last time.
+    DEBUG_PRINTLN(F("Resolve failed, using expired cached address"));
+  }
+
   // Connect and check for success (0 result).
-  int r = client->connect((char *)buffer, portnum);
+  start = millis();
+  r = c->connect(b->ip, b->port);
+  connect_timing.tcp_ms += millis() - start;
   DEBUG_PRINT(F("Connect result: ")); DEBUG_PRINTLN(r);
-  return r != 0;
+  if (r == 0)
+    b->ip_valid = false;
+  return r;
+}
+
+bool Adafruit_MQTT_SPARK::connectServer(){
+  connect_timing.dns_ms = 0;
+  connect_timing.tcp_ms = 0;
+
+  // Start from the broker we were last on rather than the top of the list,
+  // so a dead primary doesn't cost a TCP timeout on every reconnect.
+  // maintainServer() takes care of moving back up.
+  for (uint8_t n=0; n<broker_count; n++) {
+    uint8_t i = (broker_current + n) % broker_count;
+    if (openBroker(client, i) == 0)
+      continue;
+    if (i != broker_current) {
+      failover_count++;
+      failback_checked_at = millis();
+    }
+    useBroker(i);
+    return true;
+  }
+  return false;
+}
+
+// Runs from keepalive(), never waits on the network.  Hands the preferred
+// brokers to the probe thread, and moves to one once the thread says it
+// answered.
+void Adafruit_MQTT_SPARK::maintainServer() {
+  if (probe_state == MQTT_PROBE_DONE) {
+    int8_t i = probe_found;
+    if (i >= 0 && i < broker_current) {
+      // Only drop the working session once a better broker accepted a connection.
+      DEBUG_PRINT(F("Broker is back: ")); DEBUG_PRINTLN(brokers[i].server);
+      brokers[i].ip = probe_ip;
+      brokers[i].ip_valid = true;
+      brokers[i].ip_resolved_at = millis();
+      probe_state = MQTT_PROBE_IDLE;
+      disconnect();
+      useBroker(i);
+      return;
+    }
+    probe_state = MQTT_PROBE_IDLE;
+  }
+
+  if (broker_current == 0 || probe_state != MQTT_PROBE_IDLE)
+    return;
+  if ((millis() - failback_checked_at) < MQTT_FAILBACK_INTERVAL_MS)
+    return;
+  failback_checked_at = millis();
+
+  // Copies, so a reconnect here can update the real ones while the probe runs.
+  for (uint8_t i=0; i<broker_current; i++)
+    probe_targets[i] = brokers[i];
+  probe_count = broker_current;
+  probe_found = -1;
+  probe_state = MQTT_PROBE_RUNNING;
+  if (!probe_thread_started) {
+    probe_thread = Thread("mqttprobe", probeThread, this);
+    probe_thread_started = true;
+  }
+}
+
+// Probe thread: try each target in turn, blocking is fine here.  The probe
+// isn't a connect attempt, so it leaves connectTiming() alone.
+void Adafruit_MQTT_SPARK::runProbes() {
+  for (uint8_t i=0; i<probe_count; i++) {
+    Adafruit_MQTT_Broker *b = &probe_targets[i];
+    IPAddress ip;
+
+    if (b->ip_valid && (millis() - b->ip_resolved_at) < MQTT_DNS_CACHE_TTL_MS)
+      ip = b->ip;
+    else
+      ip = WiFi.resolve(b->server);
+    if (!ip && b->ip_valid)
+      ip = b->ip;  // DNS is down, try where it was last time
+    if (!ip)
+      continue;
+    if (probe.connect(ip, b->port) == 0)
+      continue;
+    probe.stop();
+    probe_ip = ip;
+    probe_found = i;
+    return;
+  }
+}
+
+os_thread_return_t Adafruit_MQTT_SPARK::probeThread(void *param) {
+  Adafruit_MQTT_SPARK *mqtt = (Adafruit_MQTT_SPARK *)param;
+
+  while (true) {
+    if (mqtt->probe_state != MQTT_PROBE_RUNNING) {
+      delay(MQTT_PROBE_IDLE_MS);
+      continue;
+    }
+    mqtt->runProbes();
+    mqtt->probe_state = MQTT_PROBE_DONE;
+  }
 }
 
 bool Adafruit_MQTT_SPARK::disconnectServer() {
@@ -126,3 +324,24 @@ bool Adafruit_MQTT_SPARK::sendPacket(uint8_t *buffer, uint16_t len) {
   }
   return true;
 }
+
+bool Adafruit_MQTT_SPARK::storeOutbox(uint16_t offset, const uint8_t *data, uint16_t len) {
+  if (outbox_address < 0)
+    return false;
+  // Only touch bytes that changed, the emulated EEPROM lives in flash.
+  for (uint16_t i=0; i<len; i++) {
+    int addr = outbox_address + offset + i;
+    if (EEPROM.read(addr) != data[i])
+      EEPROM.write(addr, data[i]);
+  }
+  return true;
+}
+
+bool Adafruit_MQTT_SPARK::loadOutbox(uint16_t offset, uint8_t *data, uint16_t len) {
+  if (outbox_address < 0)
+    return false;
+  for (uint16_t i=0; i<len; i++) {
+    data[i] = EEPROM.read(outbox_address + offset + i);
+  }
+  return true;
+}
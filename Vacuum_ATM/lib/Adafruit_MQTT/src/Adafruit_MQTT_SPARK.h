@@ -22,6 +22,7 @@
 #ifndef _ADAFRUIT_MQTT_CLIENT_H_
 #define _ADAFRUIT_MQTT_CLIENT_H_
 
+#include <atomic>
 #include "spark_wiring_string.h"
 #include "spark_wiring_tcpclient.h"
 #include "spark_wiring_usbserial.h"
@@ -31,6 +32,38 @@
 // How long to delay waiting for new data to be available in readPacket.
 #define MQTT_CLIENT_READINTERVAL_MS 10
 
+// How long a resolved broker address is reused before asking DNS again.
+// A failed connect to the cached address always forces a fresh lookup.
+#define MQTT_DNS_CACHE_TTL_MS (60UL*60UL*1000UL)
+
+// Most brokers to fail over between, the one given to the constructor counts.
+#define MQTT_MAX_BROKERS 3
+
+// While on a fallback broker, how often to check whether a broker higher up
+// the list is reachable again.  The check runs on its own thread, a broker
+// that doesn't answer costs that thread a TCP timeout and the loop nothing.
+#define MQTT_FAILBACK_INTERVAL_MS (5UL*60UL*1000UL)
+
+// How often the probe thread looks for work when it has none.
+#define MQTT_PROBE_IDLE_MS 100
+
+// Where the failback probe is up to, handed between keepalive() and the thread.
+#define MQTT_PROBE_IDLE    0
+#define MQTT_PROBE_RUNNING 1
+#define MQTT_PROBE_DONE    2
+
+
+// One broker to try, with its own login and resolver cache.
+struct Adafruit_MQTT_Broker {
+  const char *server;
+  uint16_t port;
+  const char *user;
+  const char *pass;
+  IPAddress ip;
+  bool ip_valid;
+  uint32_t ip_resolved_at;
+};
+
 
 // MQTT client implementation for a generic Arduino Client interface.  Can work
 // with almost all Arduino network hardware like ethernet shield, wifi shield,
@@ -40,14 +73,20 @@ class Adafruit_MQTT_SPARK : public Adafruit_MQTT {
   Adafruit_MQTT_SPARK(TCPClient *client, const char *server, uint16_t port,
                        const char *cid, const char *user, const char *pass):
     Adafruit_MQTT(server, port, cid, user, pass),
-    client(client)
-  {}
+    client(client),
+    outbox_address(-1)
+  {
+    initBrokers(server, port, user, pass);
+  }
 
   Adafruit_MQTT_SPARK(TCPClient *client, const char *server, uint16_t port,
                        const char *user="", const char *pass=""):
     Adafruit_MQTT(server, port, user, pass),
-    client(client)
-  {}
+    client(client),
+    outbox_address(-1)
+  {
+    initBrokers(server, port, user, pass);
+  }
   
   bool Update();
 
@@ -57,8 +96,60 @@ class Adafruit_MQTT_SPARK : public Adafruit_MQTT {
   uint16_t readPacket(uint8_t *buffer, uint16_t maxlen, int16_t timeout);
   bool sendPacket(uint8_t *buffer, uint16_t len);
 
+  // Add another broker to fail over to.  Brokers are tried in order, the
+  // one passed to the constructor first, unless preferred puts this one at
+  // the head of the list, e.g. a broker on the LAN with the cloud behind it.
+  // After a failover the client moves back up the list on its own once a
+  // better broker answers again.  Returns false when the list is full.
+  bool addBroker(const char *server, uint16_t port, const char *user = "",
+                 const char *pass = "", bool preferred = false);
+
+  // Position in the list of the broker in use, 0 is the most preferred, and
+  // how many times connect() had to move to another broker.
+  uint8_t brokerIndex() const { return broker_current; }
+  const char *brokerName() const { return brokers[broker_current].server; }
+  uint32_t failovers() const { return failover_count; }
+
+  // Forget the cached broker addresses so the next connect resolves again.
+  void flushDnsCache();
+
+  // Keep the outbox in EEPROM starting at address so queued publishes
+  // survive a reset.  Call in setup() before the first publish.
+  void setOutboxStorage(int address) { outbox_address = address; }
+
+ protected:
+  bool storeOutbox(uint16_t offset, const uint8_t *data, uint16_t len);
+  bool loadOutbox(uint16_t offset, uint8_t *data, uint16_t len);
+  void maintainServer();
+
  private:
   TCPClient* client;
+  TCPClient probe;          // checks a preferred broker without dropping the session
+
+  // The probe thread only touches these.  keepalive() fills in the targets
+  // before setting probe_state to RUNNING, the thread fills in the result
+  // before setting it to DONE.
+  Thread probe_thread;
+  bool probe_thread_started;
+  std::atomic<uint8_t> probe_state;
+  Adafruit_MQTT_Broker probe_targets[MQTT_MAX_BROKERS];
+  uint8_t probe_count;      // brokers above the current one, best first
+  int8_t probe_found;       // first of them that answered, -1 for none
+  IPAddress probe_ip;       // the address it answered on
+
+  Adafruit_MQTT_Broker brokers[MQTT_MAX_BROKERS];
+  uint8_t broker_count;
+  uint8_t broker_current;
+  uint32_t failover_count;
+  uint32_t failback_checked_at;
+
+  void initBrokers(const char *server, uint16_t port, const char *user, const char *pass);
+  int openBroker(TCPClient *c, uint8_t i);
+  void useBroker(uint8_t i);
+  void runProbes();
+  static os_thread_return_t probeThread(void *param);
+
+  int outbox_address;
 };
 
 
@@ -1,12 +1,66 @@
 #ifndef _BUTTON_H_
 #define _BUTTON_H_
 
+const int BUTTON_EVENT_QUEUE = 8;   //edges held until read, must be a power of two
+const int BUTTON_DEBOUNCE_MS = 20;
+
+//One debounced edge captured by the interrupt
+struct ButtonEvent{
+    bool pressed;           //true = pressed, false = released
+    unsigned long timeMs;   //millis() when it happened
+};
+
 class Button{
     int _buttonPin;
     int _prevButtonState;
     int _prevRButtonState;
     bool _pullUp;
 
+    //Interrupt mode - the ISR only writes _head, the loop only writes _tail
+    volatile ButtonEvent _events[BUTTON_EVENT_QUEUE];  //volatile keeps the slot written before _head moves
+    volatile unsigned int _head = 0;
+    volatile unsigned int _tail = 0;
+    volatile bool _level = false;           //debounced state
+    volatile unsigned long _levelTime = 0;
+    volatile unsigned long _dropped = 0;
+    unsigned int _debounceMs = BUTTON_DEBOUNCE_MS;
+    bool _isInterrupt = false;
+
+    //Runs in the interrupt - take the new level unless it's bounce from the last edge
+    void onEdge(){
+        bool level = isPressed();
+        unsigned long now = millis();
+
+        if(level == _level || now - _levelTime < _debounceMs){
+            return;
+        }
+        pushEvent(level, now);
+    }
+
+    void pushEvent(bool level, unsigned long now){
+        _level = level;
+        _levelTime = now;
+        if(_head - _tail >= BUTTON_EVENT_QUEUE){
+            _dropped++;     //full, the loop will still see the level through isPressed()
+            return;
+        }
+        _events[_head % BUTTON_EVENT_QUEUE].pressed = level;
+        _events[_head % BUTTON_EVENT_QUEUE].timeMs = now;
+        _head++;
+    }
+
+    //An edge ignored as bounce can leave us on the wrong level if nothing follows
+    //  it. Once things have been quiet for the debounce time, go with the pin.
+    void settle(){
+        ATOMIC_BLOCK(){
+            bool level = isPressed();
+            unsigned long now = millis();
+            if(level != _level && now - _levelTime >= _debounceMs){
+                pushEvent(level, now);
+            }
+        }
+    }
+
     public:
 
         //Constructor//
@@ -23,6 +77,40 @@ class Button{
 
         //////Button Functions//////
 
+        //Capture edges with an interrupt instead of polling, so none are missed
+        //  while the loop is busy. Call from setup(), then read them with getEvent().
+        bool beginInterrupt(unsigned int debounceMs=BUTTON_DEBOUNCE_MS){
+            _debounceMs = debounceMs;
+            _level = isPressed();
+            _levelTime = millis();
+            _isInterrupt = attachInterrupt(_buttonPin, &Button::onEdge, this, CHANGE);
+            return _isInterrupt;
+        }
+
+        //Take the oldest edge off the queue, false if there isn't one
+        bool getEvent(ButtonEvent *event){
+            if(_isInterrupt && _head == _tail){
+                settle();
+            }
+            if(_head == _tail){
+                return false;
+            }
+            event->pressed = _events[_tail % BUTTON_EVENT_QUEUE].pressed;
+            event->timeMs = _events[_tail % BUTTON_EVENT_QUEUE].timeMs;
+            _tail++;
+            return true;
+        }
+
+        //Forget edges nobody has read yet
+        void clearEvents(){
+            _tail = _head;
+        }
+
+        //Edges lost because the queue was full
+        unsigned long droppedEvents(){
+            return _dropped;
+        }
+
         //Checks if button is currently pressed down
         bool isPressed(){
             bool _buttonState;
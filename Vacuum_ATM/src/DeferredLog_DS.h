@@ -0,0 +1,282 @@
+#ifndef _DEFERREDLOG_DS_
+#define _DEFERREDLOG_DS_
+
+#include <atomic>
+
+const int TRACE_RING_SIZE = 4096;       //bytes, a power of 2
+const int TRACE_MAX_RECORD = 255;       //payload bytes in one record
+const int TRACE_MAX_STRING = 96;        //longest %s argument kept
+const int TRACE_MAX_FORMATS = 64;       //different format strings per boot
+const int TRACE_HASH_SLOTS = 128;
+const int TRACE_IDLE_WAIT = 10;         //ms the drain thread sleeps when there's nothing to send
+const uint8_t TRACE_SYNC = 0x1E;        //starts every record, never shows up in text
+const uint16_t TRACE_DEFINITION = 0x8000;   //id flag, the record holds a format's text
+
+//Log lines as binary records, formatted later on the PC by Tools/TraceDecode
+//  trace.printf() takes the same arguments as Serial.printf(), but only copies them into
+//  a ring buffer with the format's id - no formatting, no waiting on USB. A thread sends
+//  the records to Serial while something is listening, and each format's text the first
+//  time it's used (again after every reconnect), so the decoder learns them as it goes.
+//  Records wait in the ring until then, newest dropped once it's full.
+//
+//  On the wire: SYNC, length, then length bytes of payload, then a checksum that makes
+//  the bytes after SYNC sum to 0. A log record's payload is a 2 byte id, 4 byte millis(),
+//  then the arguments - 4 bytes for integers and floats (as float), 8 for 64-bit, and
+//  a length byte plus the text for strings. A definition's payload is the id with
+//  TRACE_DEFINITION set, then the format text. Anything else written to Serial comes
+//  through the decoder as plain text.
+//
+//  One writer: call printf() from the application thread only, never from an ISR or a
+//  Timer callback.
+class DeferredLog {
+    uint8_t _ring[TRACE_RING_SIZE];
+    std::atomic<uint32_t> _head;        //written by printf(), free running
+    std::atomic<uint32_t> _tail;        //written by the drain thread
+    const char *_formats[TRACE_MAX_FORMATS];
+    std::atomic<int> _formatCount;
+    uint8_t _formatHash[TRACE_HASH_SLOTS];  //format id + 1, 0 is empty
+    uint32_t _dropped;
+    uint32_t _droppedTotal;
+    Thread _thread;
+
+    //Format id for a format string, keyed by its address - it lives in flash and never moves
+    int formatId(const char *format){
+        uint32_t slot = ((uintptr_t)format >> 2) % TRACE_HASH_SLOTS;
+
+        for(int i=0; i<TRACE_HASH_SLOTS; i++){
+            uint8_t entry = _formatHash[slot];
+            if(entry == 0){
+                int count = _formatCount.load(std::memory_order_relaxed);
+                if(count >= TRACE_MAX_FORMATS){
+                    return -1;
+                }
+                _formats[count] = format;
+                _formatHash[slot] = count + 1;
+                _formatCount.store(count + 1, std::memory_order_release);
+                return count;
+            }
+            if(_formats[entry - 1] == format){
+                return entry - 1;
+            }
+            slot = (slot + 1) % TRACE_HASH_SLOTS;
+        }
+        return -1;
+    }
+
+    static void putBytes(uint8_t *rec, int &len, const void *data, int count){
+        count = min(count, TRACE_MAX_RECORD + 2 - len);
+        if(count > 0){
+            memcpy(rec + len, data, count);
+            len = len + count;
+        }
+    }
+
+    //One overload per kind of argument, picked by the compiler so printf() never reads the format
+    static void put(uint8_t *rec, int &len, long n){
+        int32_t n32 = n;
+        putBytes(rec, len, &n32, 4);
+    }
+    static void put(uint8_t *rec, int &len, unsigned long n){
+        uint32_t n32 = n;
+        putBytes(rec, len, &n32, 4);
+    }
+    static void put(uint8_t *rec, int &len, int n){
+        put(rec, len, (long)n);
+    }
+    static void put(uint8_t *rec, int &len, unsigned int n){
+        put(rec, len, (unsigned long)n);
+    }
+    static void put(uint8_t *rec, int &len, short n){
+        put(rec, len, (long)n);
+    }
+    static void put(uint8_t *rec, int &len, unsigned short n){
+        put(rec, len, (unsigned long)n);
+    }
+    static void put(uint8_t *rec, int &len, char n){
+        put(rec, len, (long)n);
+    }
+    static void put(uint8_t *rec, int &len, signed char n){
+        put(rec, len, (long)n);
+    }
+    static void put(uint8_t *rec, int &len, unsigned char n){
+        put(rec, len, (unsigned long)n);
+    }
+    static void put(uint8_t *rec, int &len, bool n){
+        put(rec, len, (long)n);
+    }
+    static void put(uint8_t *rec, int &len, long long n){
+        putBytes(rec, len, &n, 8);
+    }
+    static void put(uint8_t *rec, int &len, unsigned long long n){
+        putBytes(rec, len, &n, 8);
+    }
+    static void put(uint8_t *rec, int &len, double n){
+        float f = n;
+        putBytes(rec, len, &f, 4);
+    }
+    static void put(uint8_t *rec, int &len, const char *s){
+        uint8_t count = s ? strnlen(s, TRACE_MAX_STRING) : 0;
+        count = max(min((int)count, TRACE_MAX_RECORD + 1 - len), 0);
+        putBytes(rec, len, &count, 1);
+        putBytes(rec, len, s, count);
+    }
+    static void put(uint8_t *rec, int &len, char *s){
+        put(rec, len, (const char *)s);
+    }
+    template <typename T>
+    static void put(uint8_t *rec, int &len, T *p){
+        put(rec, len, (unsigned long)(uintptr_t)p);    //%p
+    }
+
+    //Fill in sync, length and checksum around the payload at rec + 2
+    static void seal(uint8_t *rec, int len){
+        uint8_t sum = 0;
+
+        rec[0] = TRACE_SYNC;
+        rec[1] = len - 2;
+        for(int i=1; i<len; i++){
+            sum = sum + rec[i];
+        }
+        rec[len] = -sum;
+    }
+
+    //Copy a finished record into the ring, false if there's no room
+    bool commit(uint8_t *rec, int len){
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        uint32_t tail = _tail.load(std::memory_order_acquire);
+
+        if(TRACE_RING_SIZE - (head - tail) < (uint32_t)len + 1){
+            return false;
+        }
+        seal(rec, len);
+        for(int i=0; i<=len; i++){
+            _ring[(head + i) % TRACE_RING_SIZE] = rec[i];
+        }
+        _head.store(head + len + 1, std::memory_order_release);
+        return true;
+    }
+
+    //Start a record - sync, length and checksum are filled in by commit()
+    static void start(uint8_t *rec, int &len, int id){
+        uint16_t id16 = id;
+        uint32_t now = millis();
+
+        len = 2;
+        putBytes(rec, len, &id16, 2);
+        putBytes(rec, len, &now, 4);
+    }
+
+    //Say how many were lost before the next record goes in
+    bool reportDropped(){
+        uint8_t rec[TRACE_MAX_RECORD + 3];
+        int len;
+
+        if(_dropped == 0){
+            return true;
+        }
+        start(rec, len, 0);
+        put(rec, len, _dropped);
+        if(!commit(rec, len)){
+            return false;
+        }
+        _dropped = 0;
+        return true;
+    }
+
+    static os_thread_return_t drainThread(void *param){
+        ((DeferredLog *)param)->drain();
+    }
+
+    void sendDefinition(int id){
+        uint8_t rec[TRACE_MAX_RECORD + 3];
+        uint16_t id16 = id | TRACE_DEFINITION;
+        int len = 2;
+
+        putBytes(rec, len, &id16, 2);
+        putBytes(rec, len, _formats[id], strnlen(_formats[id], TRACE_MAX_RECORD - 2));
+        seal(rec, len);
+        Serial.write(rec, len + 1);
+    }
+
+    void drain(){
+        bool wasConnected = false;
+        int definitionsSent = 0;
+        uint8_t chunk[64];
+
+        while(true){
+            if(!Serial.isConnected()){
+                wasConnected = false;   //keep everything for whoever connects next
+                delay(TRACE_IDLE_WAIT);
+                continue;
+            }
+            if(!wasConnected){
+                definitionsSent = 0;    //a new listener hasn't seen any of them
+                wasConnected = true;
+            }
+            uint32_t head = _head.load(std::memory_order_acquire);
+            uint32_t tail = _tail.load(std::memory_order_relaxed);
+            if(head == tail){
+                delay(TRACE_IDLE_WAIT);
+                continue;
+            }
+            //every format these records use was registered before head moved
+            int formatCount = _formatCount.load(std::memory_order_acquire);
+            for(; definitionsSent < formatCount; definitionsSent++){
+                sendDefinition(definitionsSent);
+            }
+            while(tail != head){
+                int count = min(head - tail, (uint32_t)sizeof(chunk));
+                for(int i=0; i<count; i++){
+                    chunk[i] = _ring[(tail + i) % TRACE_RING_SIZE];
+                }
+                Serial.write(chunk, count);
+                tail = tail + count;
+                _tail.store(tail, std::memory_order_release);
+            }
+        }
+    }
+
+    public:
+
+        DeferredLog(){
+            _head = 0;
+            _tail = 0;
+            _formatCount = 0;
+            _dropped = _droppedTotal = 0;
+            memset(_formatHash, 0, sizeof(_formatHash));
+            formatId("### %lu log records dropped ###\n");     //id 0
+        }
+
+        //Start the drain thread, call from setup() after Serial.begin()
+        void begin(){
+            _thread = Thread("trace", drainThread, this);
+        }
+
+        //Same as Serial.printf(), but the formatting happens on the PC
+        template <typename... Args>
+        void printf(const char *format, Args... args){
+            uint8_t rec[TRACE_MAX_RECORD + 3];
+            int len;
+            int id = formatId(format);
+
+            if(id < 0 || !reportDropped()){
+                _dropped++;
+                _droppedTotal++;
+                return;
+            }
+            start(rec, len, id);
+            int unused[] = {0, (put(rec, len, args), 0)...};
+            (void)unused;
+            if(!commit(rec, len)){
+                _dropped++;
+                _droppedTotal++;
+            }
+        }
+
+        //Records lost to a full ring or too many formats since boot
+        unsigned long dropped(){
+            return _droppedTotal;
+        }
+};
+
+#endif  //_DEFERREDLOG_DS_
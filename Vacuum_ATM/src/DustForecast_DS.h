@@ -0,0 +1,108 @@
+#ifndef _DUSTFORECAST_DS_
+#define _DUSTFORECAST_DS_
+
+#include <math.h>
+
+const int FORECAST_SLOT_TIME = 21600;       //seconds per time-of-week slot, 6 h
+const int FORECAST_SLOTS = 604800 / FORECAST_SLOT_TIME;     //28 slots in a week
+const float FORECAST_TAU = 86400;           //overall rate forgets over about a day
+const float FORECAST_SLOT_TAU = 43200;      //a slot's rate over about two visits
+const int FORECAST_MAX_GAP = 86400;         //longer than this between samples, don't guess a rate
+const int FORECAST_HORIZON = 2419200;       //don't look further ahead than 4 weeks
+
+//Dust rate forecast, updated a sample at a time
+//  Keeps an EWMA of dust per second overall and one for each 6 h slot of the week, so
+//  a dusty Saturday counts toward Saturdays. Samples arrive unevenly, so each one is
+//  weighted by the time it covers. secondsUntil() walks the slots ahead, using a
+//  slot's own rate once it has one and the overall rate until then.
+class DustForecast {
+    float _rate;
+    float _slotRate[FORECAST_SLOTS];
+    bool _isSlotSeen[FORECAST_SLOTS];
+    uint32_t _lastTime;
+    bool _hasRate;
+
+    static int slotOf(uint32_t time){
+        return (time % 604800) / FORECAST_SLOT_TIME;
+    }
+
+    public:
+
+        DustForecast(){
+            reset();
+        }
+
+        void reset(){
+            _rate = 0;
+            _lastTime = 0;
+            _hasRate = false;
+            for(int i=0; i<FORECAST_SLOTS; i++){
+                _slotRate[i] = 0;
+                _isSlotSeen[i] = false;
+            }
+        }
+
+        //dust is the amount counted since the last sample, time in epoch seconds
+        void add(uint32_t time, int32_t dust){
+            uint32_t gap = time - _lastTime;
+
+            if(_lastTime == 0 || time <= _lastTime || gap > FORECAST_MAX_GAP){
+                _lastTime = time;   //nothing to measure from yet
+                return;
+            }
+            _lastTime = time;
+
+            float rate = (float)dust / gap;
+            if(!_hasRate){
+                _rate = rate;
+                _hasRate = true;
+            } else{
+                _rate = _rate + (rate - _rate) * (1 - expf(-(float)gap / FORECAST_TAU));
+            }
+
+            int slot = slotOf(time - gap / 2);      //the slot most of it happened in
+            if(!_isSlotSeen[slot]){
+                _slotRate[slot] = rate;
+                _isSlotSeen[slot] = true;
+            } else{
+                _slotRate[slot] = _slotRate[slot] + (rate - _slotRate[slot]) * (1 - expf(-(float)gap / FORECAST_SLOT_TAU));
+            }
+        }
+
+        bool hasRate(){
+            return _hasRate;
+        }
+
+        //Dust per hour right now
+        float ratePerHour(){
+            return _rate * 3600;
+        }
+
+        //Seconds from now until that much more dust has come in, -1 if not within the horizon
+        int secondsUntil(uint32_t now, float dust){
+            uint32_t time = now;
+
+            if(dust <= 0){
+                return 0;
+            }
+            if(!_hasRate){
+                return -1;
+            }
+            while(time - now < FORECAST_HORIZON){
+                int slot = slotOf(time);
+                float rate = _isSlotSeen[slot] ? _slotRate[slot] : _rate;
+                uint32_t slotLeft = FORECAST_SLOT_TIME - time % FORECAST_SLOT_TIME;
+
+                if(rate > 0 && rate * slotLeft >= dust){
+                    return time - now + (uint32_t)(dust / rate);
+                }
+                if(rate > 0){
+                    dust = dust - rate * slotLeft;
+                }
+                time = time + slotLeft;
+            }
+            return -1;
+        }
+};
+
+#endif  //_DUSTFORECAST_DS_
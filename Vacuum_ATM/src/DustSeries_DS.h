@@ -0,0 +1,287 @@
+#ifndef _DUSTSERIES_DS_
+#define _DUSTSERIES_DS_
+
+#include <stddef.h>
+#include "LogStore_DS.h"    //logCRC16()
+
+const int DUST_BLOCK_LEN = 128;     //bytes per block, in RAM and in EEPROM
+const int DUST_BLOCKS = 16;         //blocks in the ring, the oldest is dropped when it's full
+const int DUST_BLOCK_DATA = DUST_BLOCK_LEN - 16;     //less the 12 byte header and 4 byte trailer
+
+//A run of samples. Each sample is two zigzag varints: how much the gap since the
+//  last sample changed (delta of delta, so steady readings cost one byte), and how
+//  much the value changed. The first sample in a block is relative to start and 0.
+struct DustBlock{
+    uint32_t seq;       //counts up from 1, 0 is an unused block
+    uint32_t start;     //epoch seconds
+    uint16_t count;     //samples in data
+    uint8_t len;        //bytes used in data
+    uint8_t flags;      //unused, 0
+    uint8_t data[DUST_BLOCK_DATA];
+    uint16_t crc;       //CRC-16 of everything before it - blank EEPROM never passes
+    uint16_t pad;
+};
+static_assert(sizeof(DustBlock) == DUST_BLOCK_LEN, "DustBlock must match DUST_BLOCK_LEN");
+
+//Totals for one stretch of time
+struct DustBucket{
+    int32_t min;
+    int32_t max;
+    int64_t sum;
+    uint32_t count;
+};
+
+inline uint32_t dustZigzag(int32_t n){
+    return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+}
+
+inline int32_t dustUnzigzag(uint32_t n){
+    return (int32_t)(n >> 1) ^ -(int32_t)(n & 1);
+}
+
+//Returns bytes written, at most 5
+inline int dustPutVarint(uint8_t *buf, uint32_t n){
+    int len = 0;
+
+    while(n >= 0x80){
+        buf[len++] = (n & 0x7F) | 0x80;
+        n = n >> 7;
+    }
+    buf[len++] = n;
+    return len;
+}
+
+//Returns bytes read, 0 if it runs past end
+inline int dustGetVarint(const uint8_t *buf, const uint8_t *end, uint32_t *n){
+    int len = 0;
+
+    *n = 0;
+    while(buf + len < end && len < 5){
+        uint8_t b = buf[len];
+        *n = *n | (uint32_t)(b & 0x7F) << (7 * len);
+        len++;
+        if(!(b & 0x80)){
+            return len;
+        }
+    }
+    return 0;
+}
+
+//Ring of timestamped dust samples, kept in RAM and copied to EEPROM a block at a time
+//  A block goes to EEPROM when it fills up, or on sync() for the one still filling,
+//  so power loss only costs the samples since the last sync.
+class DustSeries {
+    int _address;
+    DustBlock _blocks[DUST_BLOCKS];
+    uint32_t _headSeq;      //block being filled, 0 before the first sample
+    uint32_t _lastTime;
+    int32_t _lastDelta;
+    int32_t _lastValue;
+    bool _isHeadDirty;
+
+    DustBlock &block(uint32_t seq){
+        return _blocks[seq % DUST_BLOCKS];
+    }
+
+    uint16_t blockCRC(const DustBlock &b){
+        return logCRC16((const uint8_t *)&b, offsetof(DustBlock, crc));
+    }
+
+    void writeBlock(uint32_t seq){
+        DustBlock &b = block(seq);
+
+        b.crc = blockCRC(b);
+        EEPROM.put(_address + (seq % DUST_BLOCKS) * DUST_BLOCK_LEN, b);
+    }
+
+    void newBlock(uint32_t time){
+        _headSeq++;
+        DustBlock &b = block(_headSeq);
+        memset(&b, 0, sizeof(b));
+        b.seq = _headSeq;
+        b.start = time;
+        _lastTime = time;
+        _lastDelta = 0;
+        _lastValue = 0;
+    }
+
+    //Calls f(time, value) for every sample in a block, oldest first
+    template <typename F>
+    void decode(const DustBlock &b, F f){
+        const uint8_t *p = b.data;
+        const uint8_t *end = b.data + b.len;
+        uint32_t time = b.start;
+        int32_t delta = 0;
+        int32_t value = 0;
+
+        for(int i=0; i<b.count; i++){
+            uint32_t dod, change;
+            int n = dustGetVarint(p, end, &dod);
+            int m = n ? dustGetVarint(p + n, end, &change) : 0;
+            if(!m){
+                return;     //bad block, keep what we got
+            }
+            p = p + n + m;
+            delta = delta + dustUnzigzag(dod);
+            time = time + delta;
+            value = value + dustUnzigzag(change);
+            f(time, value);
+        }
+    }
+
+    public:
+
+        //Keeps its blocks in DUST_BLOCKS * DUST_BLOCK_LEN bytes of EEPROM from address
+        DustSeries(int address){
+            _address = address;
+            _headSeq = 0;
+            _lastTime = 0;
+            _lastDelta = _lastValue = 0;
+            _isHeadDirty = false;
+            memset(_blocks, 0, sizeof(_blocks));
+        }
+
+        //Load the blocks saved in EEPROM, call once from setup()
+        void begin(){
+            for(int i=0; i<DUST_BLOCKS; i++){
+                DustBlock &b = _blocks[i];
+                EEPROM.get(_address + i * DUST_BLOCK_LEN, b);
+                if(b.crc != blockCRC(b) || b.seq == 0 || b.seq % DUST_BLOCKS != (uint32_t)i || b.len > DUST_BLOCK_DATA){
+                    memset(&b, 0, sizeof(b));
+                    continue;
+                }
+                if(b.seq > _headSeq){
+                    _headSeq = b.seq;
+                }
+            }
+            //drop anything left over from before the newest blocks went round
+            for(int i=0; i<DUST_BLOCKS; i++){
+                if(_blocks[i].seq + DUST_BLOCKS <= _headSeq){
+                    memset(&_blocks[i], 0, sizeof(_blocks[i]));
+                }
+            }
+            //pick up where the block being filled left off
+            if(_headSeq != 0){
+                DustBlock &head = block(_headSeq);
+                _lastTime = head.start;
+                _lastDelta = 0;
+                _lastValue = 0;
+                decode(head, [this](uint32_t time, int32_t value){
+                    _lastDelta = time - _lastTime;
+                    _lastTime = time;
+                    _lastValue = value;
+                });
+            }
+        }
+
+        //Add a sample, time in epoch seconds and never going backwards
+        void add(uint32_t time, int32_t value){
+            uint8_t sample[10];
+            int len;
+
+            if(_headSeq == 0){
+                newBlock(time);
+            }
+            if(time < _lastTime){
+                time = _lastTime;
+            }
+            for(int tries=0; tries<2; tries++){
+                int32_t delta = time - _lastTime;
+                len = dustPutVarint(sample, dustZigzag(delta - _lastDelta));
+                len = len + dustPutVarint(sample + len, dustZigzag(value - _lastValue));
+
+                DustBlock &b = block(_headSeq);
+                if(b.len + len <= DUST_BLOCK_DATA && b.count < 0xFFFF){
+                    memcpy(b.data + b.len, sample, len);
+                    b.len = b.len + len;
+                    b.count++;
+                    _lastDelta = delta;
+                    _lastTime = time;
+                    _lastValue = value;
+                    _isHeadDirty = true;
+                    return;
+                }
+                //full - save it and start the next one, taking the oldest block's place
+                writeBlock(_headSeq);
+                _isHeadDirty = false;
+                newBlock(time);
+            }
+        }
+
+        //Save the block that's still filling, if it changed
+        void sync(){
+            if(_isHeadDirty){
+                writeBlock(_headSeq);
+                _isHeadDirty = false;
+            }
+        }
+
+        //Calls f(time, value) for every sample held, oldest first
+        template <typename F>
+        void forEach(F f){
+            if(_headSeq == 0){
+                return;
+            }
+            uint32_t first = _headSeq >= DUST_BLOCKS ? _headSeq - DUST_BLOCKS + 1 : 1;
+            for(uint32_t seq=first; seq<=_headSeq; seq++){
+                if(block(seq).seq == seq){
+                    decode(block(seq), f);
+                }
+            }
+        }
+
+        //Fill count buckets of bucketSeconds each, starting at since
+        //  Returns how many buckets got samples.
+        int query(uint32_t since, uint32_t bucketSeconds, DustBucket *buckets, int count){
+            int filled = 0;
+
+            for(int i=0; i<count; i++){
+                buckets[i].min = INT32_MAX;
+                buckets[i].max = INT32_MIN;
+                buckets[i].sum = 0;
+                buckets[i].count = 0;
+            }
+            if(bucketSeconds == 0){
+                return 0;
+            }
+            forEach([&](uint32_t time, int32_t value){
+                if(time < since){
+                    return;
+                }
+                uint32_t i = (time - since) / bucketSeconds;
+                if(i >= (uint32_t)count){
+                    return;
+                }
+                DustBucket &bucket = buckets[i];
+                if(bucket.count == 0){
+                    filled++;
+                }
+                bucket.min = min(bucket.min, value);
+                bucket.max = max(bucket.max, value);
+                bucket.sum = bucket.sum + value;
+                bucket.count++;
+            });
+            return filled;
+        }
+
+        //Samples held, and the time of the oldest
+        uint32_t samples(){
+            uint32_t total = 0;
+            for(int i=0; i<DUST_BLOCKS; i++){
+                total = total + _blocks[i].count;
+            }
+            return total;
+        }
+
+        uint32_t oldestTime(){
+            uint32_t first = _headSeq >= DUST_BLOCKS ? _headSeq - DUST_BLOCKS + 1 : 1;
+            for(uint32_t seq=first; seq<=_headSeq; seq++){
+                if(block(seq).seq == seq){
+                    return block(seq).start;
+                }
+            }
+            return 0;
+        }
+};
+
+#endif  //_DUSTSERIES_DS_
@@ -0,0 +1,210 @@
+#ifndef _LOGSTORE_DS_
+#define _LOGSTORE_DS_
+
+const int LOG_MAX_KEYS = 4;             //values the store can hold
+const int LOG_RECORD_LEN = 12;          //bytes per record in EEPROM
+const unsigned long LOG_FLASH_ENDURANCE = 100000;   //erase cycles the flash is rated for
+
+//One value as it sits in EEPROM
+//  seq counts up for every record written, the newest valid record for a key wins.
+//  A blank slot is all 0xFF, which never has a good CRC.
+struct LogRecord{
+    uint32_t seq;
+    uint32_t value;
+    uint8_t key;
+    uint8_t flags;      //unused, 0
+    uint16_t crc;       //CRC-16/CCITT of the first 10 bytes
+};
+static_assert(sizeof(LogRecord) == LOG_RECORD_LEN, "LogRecord must match LOG_RECORD_LEN");
+
+//CRC-16/CCITT-FALSE, bit at a time - records are small and rare
+inline uint16_t logCRC16(const uint8_t *buf, int len){
+    uint16_t crc = 0xFFFF;
+
+    for(int i=0; i<len; i++){
+        crc = crc ^ (buf[i] << 8);
+        for(int bit=0; bit<8; bit++){
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+//Small key/value store kept as a log in a region of EEPROM
+//  Each change is appended as a new record after the last one, going round the
+//  region, so writes are spread over all of it instead of hitting the same bytes.
+//  set() only changes RAM, records go out on flush(), so the caller decides how
+//  often the flash gets written.
+//  A record never goes over a key's newest copy, the log goes round those slots, so
+//  a torn write just loses the record being written. At boot begin() scans the
+//  region and keeps the newest good record for each key.
+class LogStore {
+    int _start;
+    int _slots;
+    uint32_t _nextSeq;
+    int _head;                          //slot the next record goes in
+    uint32_t _values[LOG_MAX_KEYS];
+    int _liveSlot[LOG_MAX_KEYS];        //slot holding each key's newest record, -1 if none
+    bool _isDirty[LOG_MAX_KEYS];
+    unsigned long _valueBytes;          //bytes handed to set()
+    unsigned long _flashBytes;          //bytes actually written to EEPROM
+    unsigned long _badRecords;          //records with a bad CRC found at boot
+
+    int slotAddress(int slot){
+        return _start + slot * LOG_RECORD_LEN;
+    }
+
+    bool readRecord(int slot, LogRecord *record){
+        EEPROM.get(slotAddress(slot), *record);
+        return record->key < LOG_MAX_KEYS && record->crc == logCRC16((uint8_t *)record, LOG_RECORD_LEN - 2);
+    }
+
+    void writeRecord(int key){
+        LogRecord record;
+
+        record.seq = _nextSeq++;
+        record.value = _values[key];
+        record.key = key;
+        record.flags = 0;
+        record.crc = logCRC16((uint8_t *)&record, LOG_RECORD_LEN - 2);
+        EEPROM.put(slotAddress(_head), record);
+        _flashBytes = _flashBytes + LOG_RECORD_LEN;
+        _liveSlot[key] = _head;
+        _head = (_head + 1) % _slots;
+    }
+
+    bool isLive(int slot){
+        for(int i=0; i<LOG_MAX_KEYS; i++){
+            if(_liveSlot[i] == slot){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Write a key in the next slot that isn't any key's newest record, its own included
+    //  A key that's rarely set just stays where it is while the log goes round it.
+    void append(int key){
+        for(int i=0; i<_slots && isLive(_head); i++){
+            _head = (_head + 1) % _slots;
+        }
+        writeRecord(key);
+    }
+
+    public:
+
+        //Use length bytes of EEPROM from start
+        LogStore(int start, int length){
+            _start = start;
+            _slots = length / LOG_RECORD_LEN;
+            _nextSeq = 1;
+            _head = 0;
+            _valueBytes = _flashBytes = _badRecords = 0;
+            for(int i=0; i<LOG_MAX_KEYS; i++){
+                _values[i] = 0;
+                _liveSlot[i] = -1;
+                _isDirty[i] = false;
+            }
+        }
+
+        //Find the newest value for each key, call once from setup()
+        void begin(){
+            LogRecord record;
+            uint32_t newestSeq[LOG_MAX_KEYS];
+            uint32_t lastSeq = 0;
+            int lastSlot = -1;
+            uint8_t blank[LOG_RECORD_LEN];
+
+            memset(blank, 0xFF, sizeof(blank));
+            for(int slot=0; slot<_slots; slot++){
+                if(!readRecord(slot, &record)){
+                    if(memcmp(&record, blank, LOG_RECORD_LEN) != 0){
+                        _badRecords++;
+                    }
+                    continue;
+                }
+                //signed difference keeps working when seq wraps
+                if(_liveSlot[record.key] < 0 || (int32_t)(record.seq - newestSeq[record.key]) > 0){
+                    newestSeq[record.key] = record.seq;
+                    _liveSlot[record.key] = slot;
+                    _values[record.key] = record.value;
+                }
+                if(lastSlot < 0 || (int32_t)(record.seq - lastSeq) > 0){
+                    lastSeq = record.seq;
+                    lastSlot = slot;
+                }
+            }
+            if(lastSlot >= 0){
+                _nextSeq = lastSeq + 1;
+                _head = (lastSlot + 1) % _slots;
+            }
+        }
+
+        //False if nothing has been stored for key yet
+        bool has(int key){
+            return _liveSlot[key] >= 0 || _isDirty[key];
+        }
+
+        uint32_t get(int key){
+            return _values[key];
+        }
+
+        void set(int key, uint32_t value){
+            _valueBytes = _valueBytes + sizeof(value);
+            if(has(key) && _values[key] == value){
+                return;
+            }
+            _values[key] = value;
+            _isDirty[key] = true;
+        }
+
+        //Write out anything changed since the last flush
+        void flush(){
+            for(int i=0; i<LOG_MAX_KEYS; i++){
+                if(_isDirty[i]){
+                    _isDirty[i] = false;
+                    append(i);
+                }
+            }
+        }
+
+        bool isDirty(){
+            for(int i=0; i<LOG_MAX_KEYS; i++){
+                if(_isDirty[i]){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //Bytes written to EEPROM per 100 bytes given to set(), under 100 when batching helps
+        unsigned long writeAmplification(){
+            if(_valueBytes == 0){
+                return 0;
+            }
+            return _flashBytes * 100 / _valueBytes;
+        }
+
+        //Days until each byte of the region has been written LOG_FLASH_ENDURANCE times
+        //  at the rate seen since boot, 0 until anything has been written
+        unsigned long lifetimeDays(){
+            unsigned long upSeconds = millis() / 1000;
+
+            if(_flashBytes == 0 || upSeconds == 0){
+                return 0;
+            }
+            double bytesPerDay = (double)_flashBytes * 86400 / upSeconds;
+            double days = (double)_slots * LOG_RECORD_LEN * LOG_FLASH_ENDURANCE / bytesPerDay;
+            return min(days, 4000000000.0);
+        }
+
+        unsigned long flashBytes(){
+            return _flashBytes;
+        }
+
+        unsigned long badRecords(){
+            return _badRecords;
+        }
+};
+
+#endif  //_LOGSTORE_DS_
@@ -0,0 +1,175 @@
+#ifndef _LOOPPROFILER_DS_
+#define _LOOPPROFILER_DS_
+
+const int PROFILE_BUCKETS = 26;         //loop time histogram, bucket i is 2^i to 2^(i+1) us, up to ~67 s
+const int PROFILE_MAX_SECTIONS = 8;
+const int PROFILE_WORST = 3;            //sections named in the report
+
+//Timing for one named part of the loop
+struct ProfileSection{
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t totalUs;
+};
+
+//Where loop() spends its time
+//  loopStart() at the top of loop() files the last pass into a log2 histogram, and a
+//  ProfileScope times a section. Both use the cycle counter, and fall back to millis()
+//  for anything long enough to wrap it (~21 s at 200 MHz). Everything is per window,
+//  report() sums it up and starts the next one.
+class LoopProfiler {
+    const char * const *_names;
+    int _sectionCount;
+    ProfileSection _sections[PROFILE_MAX_SECTIONS];
+    uint32_t _histogram[PROFILE_BUCKETS];
+    uint32_t _loops;
+    uint32_t _loopMaxUs;
+    uint32_t _lastTicks;
+    uint32_t _lastMillis;
+    bool _isStarted;
+
+    static int bucketOf(uint32_t us){
+        int bucket = 0;
+        while(us > 1 && bucket < PROFILE_BUCKETS - 1){
+            us = us >> 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    //Upper edge of the bucket holding the given fraction of loops, in ms
+    uint32_t percentileMs(int percent){
+        uint32_t target = (_loops * percent + 99) / 100;
+        uint32_t seen = 0;
+
+        if(_loops == 0){
+            return 0;
+        }
+        for(int i=0; i<PROFILE_BUCKETS; i++){
+            seen = seen + _histogram[i];
+            if(seen >= target){
+                return ((2ULL << i) + 999) / 1000;
+            }
+        }
+        return 0;
+    }
+
+    public:
+
+        //names are the sections, in the order of their numbers
+        LoopProfiler(const char * const *names, int count){
+            _names = names;
+            _sectionCount = min(count, PROFILE_MAX_SECTIONS);
+            _isStarted = false;
+            reset();
+        }
+
+        static uint32_t elapsedUs(uint32_t startTicks, uint32_t startMillis){
+            uint32_t ms = millis() - startMillis;
+
+            if(ms > 10000){
+                return ms * 1000;
+            }
+            return (System.ticks() - startTicks) / System.ticksPerMicrosecond();
+        }
+
+        //Call first thing in loop()
+        void loopStart(){
+            uint32_t ticks = System.ticks();
+            uint32_t now = millis();
+
+            if(_isStarted){
+                uint32_t us = elapsedUs(_lastTicks, _lastMillis);
+                _histogram[bucketOf(us)]++;
+                _loops++;
+                _loopMaxUs = max(_loopMaxUs, us);
+            }
+            _lastTicks = ticks;
+            _lastMillis = now;
+            _isStarted = true;
+        }
+
+        void record(int section, uint32_t us){
+            if(section < 0 || section >= _sectionCount){
+                return;
+            }
+            ProfileSection &s = _sections[section];
+            s.count++;
+            s.totalUs = s.totalUs + us;
+            s.maxUs = max(s.maxUs, us);
+        }
+
+        //Loop time percentiles and the sections with the longest single run, then reset
+        //  summary, if given, gets just the percentiles and the worst section, short enough to publish.
+        void report(char *buf, int len, char *summary = NULL, int summaryLen = 0){
+            int order[PROFILE_MAX_SECTIONS];
+            int used;
+
+            for(int i=0; i<_sectionCount; i++){
+                order[i] = i;
+            }
+            //a handful of sections, insertion sort by worst case
+            for(int i=1; i<_sectionCount; i++){
+                for(int j=i; j>0 && _sections[order[j]].maxUs > _sections[order[j-1]].maxUs; j--){
+                    int swap = order[j];
+                    order[j] = order[j-1];
+                    order[j-1] = swap;
+                }
+            }
+
+            used = snprintf(buf, len, "loops %lu p50<%lums p99<%lums max %lums", (unsigned long)_loops,
+                (unsigned long)percentileMs(50), (unsigned long)percentileMs(99), (unsigned long)(_loopMaxUs / 1000));
+            if(summary != NULL && summaryLen > 0){
+                int summaryUsed = snprintf(summary, summaryLen, "%s", buf);
+                if(_sectionCount > 0 && _sections[order[0]].count > 0 && summaryUsed < summaryLen){
+                    snprintf(summary + summaryUsed, summaryLen - summaryUsed, ", %s max %lums", _names[order[0]],
+                        (unsigned long)(_sections[order[0]].maxUs / 1000));
+                }
+            }
+            for(int i=0; i<min(_sectionCount, PROFILE_WORST) && used < len; i++){
+                ProfileSection &s = _sections[order[i]];
+                if(s.count == 0){
+                    break;
+                }
+                used = used + snprintf(buf + used, len - used, ", %s max %lums avg %luus", _names[order[i]],
+                    (unsigned long)(s.maxUs / 1000), (unsigned long)(s.totalUs / s.count));
+            }
+            reset();
+        }
+
+        void reset(){
+            _loops = 0;
+            _loopMaxUs = 0;
+            for(int i=0; i<PROFILE_BUCKETS; i++){
+                _histogram[i] = 0;
+            }
+            for(int i=0; i<PROFILE_MAX_SECTIONS; i++){
+                _sections[i].count = 0;
+                _sections[i].maxUs = 0;
+                _sections[i].totalUs = 0;
+            }
+        }
+};
+
+//Times the rest of the block it's declared in
+//  { ProfileScope scope(profiler, PROF_PING); MQTT_ping(); }
+class ProfileScope {
+    LoopProfiler &_profiler;
+    int _section;
+    uint32_t _startTicks;
+    uint32_t _startMillis;
+
+    public:
+
+        ProfileScope(LoopProfiler &profiler, int section): _profiler(profiler){
+            _section = section;
+            _startMillis = millis();
+            _startTicks = System.ticks();
+        }
+
+        ~ProfileScope(){
+            _profiler.record(_section, LoopProfiler::elapsedUs(_startTicks, _startMillis));
+        }
+};
+
+#endif  //_LOOPPROFILER_DS_
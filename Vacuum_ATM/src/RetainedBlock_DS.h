@@ -0,0 +1,49 @@
+#ifndef _RETAINEDBLOCK_DS_
+#define _RETAINEDBLOCK_DS_
+
+//CRC-32 (the zip one), bit at a time - only runs over a few bytes
+inline uint32_t retainedCRC32(const uint8_t *buf, int len){
+    uint32_t crc = 0xFFFFFFFF;
+
+    for(int i=0; i<len; i++){
+        crc = crc ^ buf[i];
+        for(int bit=0; bit<8; bit++){
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+//Wraps a struct kept in retained RAM, which lives through resets but not power loss
+//  Declare it with the retained keyword and no initializer, so startup leaves it alone.
+//  seal() after changing data, isValid() at boot says whether it survived. magic also
+//  changes when T does, so new firmware with a different layout starts fresh.
+template <class T>
+struct RetainedBlock{
+    uint32_t magic;
+    uint32_t crc;
+    T data;
+
+    static uint32_t expectedMagic(){
+        return 0x52455400 | (sizeof(T) & 0xFF);     //"RET" and the size
+    }
+
+    uint32_t checksum(){
+        return retainedCRC32((const uint8_t *)&data, sizeof(T));
+    }
+
+    bool isValid(){
+        return magic == expectedMagic() && crc == checksum();
+    }
+
+    void seal(){
+        magic = expectedMagic();
+        crc = checksum();
+    }
+
+    void invalidate(){
+        magic = 0;
+    }
+};
+
+#endif  //_RETAINEDBLOCK_DS_
@@ -0,0 +1,292 @@
+#ifndef _SCHEDULER_DS_
+#define _SCHEDULER_DS_
+
+const int SCHED_MAX_TASKS = 16;
+const int SCHED_SLOTS = 64;         //wheel size, a power of 2
+const int SCHED_TICK = 10;          //ms per slot, one turn of the wheel is 640 ms
+const int SCHED_NONE = -1;
+
+//A task is either a callback or an event handed to post()
+struct SchedTask{
+    void (*callback)();
+    void (*post)(int event);
+    int event;
+    unsigned int generation;    //bumped each time the task is freed, so old ids stop working
+    unsigned int period;    //ms, 0 for a one-shot
+    unsigned int rounds;    //turns of the wheel left before it's due
+    int slot;               //-1 when it's not on the wheel
+    int next;
+    int prev;
+};
+
+//Runs callbacks after a delay or every period, from loop()
+//  A hashed timing wheel - each task sits in the slot it comes due in, with the number
+//  of turns still to go, so adding and cancelling don't depend on how many tasks there
+//  are and run() only looks at the slots time has moved past. Callbacks run in loop(),
+//  so they can do anything loop() can. Times are rounded up to the 10 ms tick.
+//  Tasks come from a fixed pool. An id carries the generation of the task it was given
+//  for, so cancelling an id whose one-shot already ran can't hit whoever got it next.
+//  Time is only ever compared as millis() - _tickMs, which is unsigned, so the 49.7 day
+//  rollover of millis() comes out the same as any other ms.
+class Scheduler {
+    SchedTask _tasks[SCHED_MAX_TASKS];
+    int _slots[SCHED_SLOTS];        //first task in each slot
+    unsigned int _tick;             //last tick run() got to
+    unsigned int _tickMs;           //millis() at that tick
+    unsigned long _wakeups;         //run() calls that found something due
+    unsigned long _idleRuns;
+    unsigned long _fired;
+    unsigned long _skipped;         //periods missed in a stall and not made up
+
+    unsigned int ticksFor(unsigned int ms){
+        return max((ms + SCHED_TICK - 1) / SCHED_TICK, 1U);
+    }
+
+    //Put a task in the slot for tick due, which must be after _tick
+    void insertAt(int id, unsigned int due){
+        SchedTask &task = _tasks[id];
+
+        task.slot = due % SCHED_SLOTS;
+        task.rounds = (due - _tick - 1) / SCHED_SLOTS;
+        task.prev = SCHED_NONE;
+        task.next = _slots[task.slot];
+        if(task.next != SCHED_NONE){
+            _tasks[task.next].prev = id;
+        }
+        _slots[task.slot] = id;
+    }
+
+    void unlink(int id){
+        SchedTask &task = _tasks[id];
+
+        if(task.prev != SCHED_NONE){
+            _tasks[task.prev].next = task.next;
+        } else{
+            _slots[task.slot] = task.next;
+        }
+        if(task.next != SCHED_NONE){
+            _tasks[task.next].prev = task.prev;
+        }
+        task.slot = SCHED_NONE;
+    }
+
+    bool isUsed(int i){
+        return _tasks[i].callback != NULL || _tasks[i].post != NULL;
+    }
+
+    void release(int i){
+        _tasks[i].callback = NULL;
+        _tasks[i].post = NULL;
+        _tasks[i].generation = (_tasks[i].generation + 1) & 0x7FFFFF;
+    }
+
+    //The task an id was handed out for, -1 if it has been freed since
+    int taskOf(int id){
+        int i = id & 0xFF;
+
+        if(id < 0 || i >= SCHED_MAX_TASKS || !isUsed(i) || (unsigned int)(id >> 8) != _tasks[i].generation){
+            return SCHED_NONE;
+        }
+        return i;
+    }
+
+    int add(unsigned int ms, unsigned int period, void (*callback)(), void (*post)(int), int event){
+        for(int i=0; i<SCHED_MAX_TASKS; i++){
+            if(!isUsed(i)){
+                _tasks[i].callback = callback;
+                _tasks[i].post = post;
+                _tasks[i].event = event;
+                _tasks[i].period = period;
+                insertAt(i, _tick + ticksFor(ms));
+                return _tasks[i].generation << 8 | i;
+            }
+        }
+        return SCHED_NONE;
+    }
+
+    public:
+
+        Scheduler(){
+            for(int i=0; i<SCHED_MAX_TASKS; i++){
+                _tasks[i].callback = NULL;
+                _tasks[i].post = NULL;
+                _tasks[i].generation = 0;
+                _tasks[i].slot = SCHED_NONE;
+            }
+            for(int i=0; i<SCHED_SLOTS; i++){
+                _slots[i] = SCHED_NONE;
+            }
+            _tick = 0;
+            _tickMs = 0;
+            _wakeups = _idleRuns = _fired = _skipped = 0;
+        }
+
+        //Start the clock, call from setup() before adding tasks
+        void begin(){
+            _tickMs = millis();
+        }
+
+        //Call callback once after ms, returns the task or SCHED_NONE if they're all used
+        int after(unsigned int ms, void (*callback)()){
+            return add(ms, 0, callback, NULL, 0);
+        }
+
+        //Call callback every ms, the first time ms from now
+        int every(unsigned int ms, void (*callback)()){
+            return add(ms, ms, callback, NULL, 0);
+        }
+
+        //Same, but call post(event) - a state machine's events go straight to its queue
+        int after(unsigned int ms, void (*post)(int event), int event){
+            return add(ms, 0, NULL, post, event);
+        }
+
+        int every(unsigned int ms, void (*post)(int event), int event){
+            return add(ms, ms, NULL, post, event);
+        }
+
+        //Stop a task and free it, safe on SCHED_NONE or a one-shot that already ran
+        void cancel(int id){
+            int i = taskOf(id);
+
+            if(i == SCHED_NONE){
+                return;
+            }
+            if(_tasks[i].slot != SCHED_NONE){
+                unlink(i);
+            }
+            release(i);
+        }
+
+        bool isPending(int id){
+            int i = taskOf(id);
+            return i != SCHED_NONE && _tasks[i].slot != SCHED_NONE;
+        }
+
+        //Run everything that's come due, call every pass of loop()
+        //  A periodic task keeps to its own beat, but after a stall (a blocking connect,
+        //  a long publish) it runs once for all the periods it missed and carries on from
+        //  now, rather than running again for each one.
+        void run(){
+            unsigned int ticks = (millis() - _tickMs) / SCHED_TICK;
+            int due[SCHED_MAX_TASKS];
+            unsigned int dueTick[SCHED_MAX_TASKS];
+            unsigned int dueGeneration[SCHED_MAX_TASKS];
+            int dueCount = 0;
+            bool isWakeup = false;
+
+            if(ticks == 0){
+                _idleRuns++;
+                return;
+            }
+            //take the due tasks off the wheel first, callbacks can add and cancel
+            _tickMs = _tickMs + ticks * SCHED_TICK;
+            for(unsigned int i=0; i<ticks; i++){
+                _tick++;
+                int id = _slots[_tick % SCHED_SLOTS];
+                while(id != SCHED_NONE){
+                    int next = _tasks[id].next;
+                    if(_tasks[id].rounds > 0){
+                        _tasks[id].rounds--;
+                    } else{
+                        unlink(id);
+                        dueTick[dueCount] = _tick;
+                        dueGeneration[dueCount] = _tasks[id].generation;
+                        due[dueCount++] = id;
+                    }
+                    id = next;
+                }
+            }
+            //periodic tasks go back on, one period after they were due or from now if that's gone
+            for(int j=0; j<dueCount; j++){
+                unsigned int period = _tasks[due[j]].period;
+                if(period > 0){
+                    unsigned int next = dueTick[j] + ticksFor(period);
+                    if((int)(next - _tick) <= 0){
+                        _skipped = _skipped + (_tick - dueTick[j]) / ticksFor(period);
+                        next = _tick + ticksFor(period);
+                    }
+                    insertAt(due[j], next);
+                }
+            }
+            for(int j=0; j<dueCount; j++){
+                SchedTask &task = _tasks[due[j]];
+                void (*callback)() = task.callback;
+                void (*post)(int) = task.post;
+                int event = task.event;
+                if(!isUsed(due[j]) || task.generation != dueGeneration[j]){
+                    continue;       //cancelled by an earlier callback, maybe handed out again
+                }
+                if(task.period == 0){
+                    release(due[j]);
+                }
+                _fired++;
+                isWakeup = true;
+                if(callback){
+                    callback();
+                } else{
+                    post(event);
+                }
+            }
+            if(isWakeup){
+                _wakeups++;
+            } else{
+                _idleRuns++;
+            }
+        }
+
+        //ms until the next task is due, up to limit - how long loop() can wait for
+        //  Only the slots inside limit are looked at, a wait longer than a turn of the wheel
+        //  checks every task.
+        unsigned int msUntilNext(unsigned int limit){
+            unsigned int elapsed = millis() - _tickMs;
+            unsigned int horizon = (limit + elapsed) / SCHED_TICK + 1;     //ticks ahead that could matter
+            unsigned int soonest = 0;
+
+            for(unsigned int ahead=1; ahead<=min(horizon, (unsigned int)SCHED_SLOTS); ahead++){
+                int id = _slots[(_tick + ahead) % SCHED_SLOTS];
+                for(; id != SCHED_NONE; id = _tasks[id].next){
+                    if(_tasks[id].rounds == 0){
+                        soonest = ahead;
+                        break;
+                    }
+                }
+                if(soonest > 0){
+                    break;
+                }
+            }
+            if(soonest == 0 && horizon > (unsigned int)SCHED_SLOTS){
+                for(int i=0; i<SCHED_MAX_TASKS; i++){
+                    if(isUsed(i) && _tasks[i].slot != SCHED_NONE){
+                        unsigned int ahead = (_tasks[i].slot - _tick - 1) % SCHED_SLOTS + 1;
+                        ahead = ahead + _tasks[i].rounds * SCHED_SLOTS;
+                        soonest = soonest == 0 ? ahead : min(soonest, ahead);
+                    }
+                }
+            }
+            if(soonest == 0){
+                return limit;
+            }
+            unsigned int ms = soonest * SCHED_TICK;
+            ms = ms > elapsed ? ms - elapsed : 0;
+            return min(ms, limit);
+        }
+
+        unsigned long wakeups(){
+            return _wakeups;
+        }
+
+        unsigned long idleRuns(){
+            return _idleRuns;
+        }
+
+        unsigned long fired(){
+            return _fired;
+        }
+
+        unsigned long skipped(){
+            return _skipped;
+        }
+};
+
+#endif  //_SCHEDULER_DS_
@@ -0,0 +1,120 @@
+#ifndef _SERVOACTUATOR_DS_
+#define _SERVOACTUATOR_DS_
+
+const int SERVO_STEP_MS = 20;       //one servo frame
+const int SERVO_SETTLE_MS = 300;    //hold at the target this long, then detach so it stops buzzing
+
+//Servo states
+const int SERVO_IDLE = 0;       //detached, nothing to do
+const int SERVO_MOVING = 1;
+const int SERVO_SETTLING = 2;   //at the target, waiting to detach
+
+//Moves a servo without blocking the loop
+//  moveTo() plans an eased move and a timer steps it every servo frame, then
+//  detaches once it has settled. Poll isDone() or set an onDone() callback.
+class ServoActuator {
+    Servo _servo;
+    int _pin;
+    volatile int _state;
+    int _from, _target, _position;
+    unsigned int _moveStart, _moveTime, _settleStart;
+    void (*_callback)(int position);
+    Timer _timer;
+
+    //Runs in the timer thread
+    void step(){
+        bool isFinished = false;
+
+        SINGLE_THREADED_BLOCK(){
+            unsigned int now = millis();
+
+            if(_state == SERVO_MOVING){
+                unsigned int elapsed = now - _moveStart;
+                int position = _target;
+                if(elapsed < _moveTime){
+                    //smoothstep, in thousandths: slow out, fast through the middle, slow in
+                    int p = elapsed * 1000 / _moveTime;
+                    int eased = p * p / 1000 * (3000 - 2 * p) / 1000;
+                    position = _from + (_target - _from) * eased / 1000;
+                } else{
+                    _state = SERVO_SETTLING;
+                    _settleStart = now;
+                }
+                if(position != _position){
+                    _servo.write(position);
+                    _position = position;
+                }
+            } else if(_state == SERVO_SETTLING && now - _settleStart >= SERVO_SETTLE_MS){
+                _servo.detach();
+                _state = SERVO_IDLE;
+                _timer.stop();
+                isFinished = true;
+            }
+        }
+        if(isFinished && _callback){
+            _callback(_position);
+        }
+    }
+
+    public:
+
+        ServoActuator(int pin):
+            _timer(SERVO_STEP_MS, &ServoActuator::step, *this)
+        {
+            _pin = pin;
+            _state = SERVO_IDLE;
+            _from = _target = _position = 0;
+            _moveStart = _moveTime = _settleStart = 0;
+            _callback = NULL;
+        }
+
+        //Go straight to position, for setup() when we don't know where it is
+        void begin(int position){
+            SINGLE_THREADED_BLOCK(){
+                _servo.attach(_pin);
+                _servo.write(position);
+                _from = _target = _position = position;
+                _state = SERVO_SETTLING;
+                _settleStart = millis();
+            }
+            _timer.start();
+        }
+
+        //Ease from wherever it is now to target over moveMs, replacing any move in progress
+        void moveTo(int target, unsigned int moveMs){
+            SINGLE_THREADED_BLOCK(){
+                if(!_servo.attached()){
+                    _servo.attach(_pin);
+                }
+                _from = _position;
+                _target = target;
+                _moveStart = millis();
+                _moveTime = moveMs;
+                _state = SERVO_MOVING;
+            }
+            _timer.start();
+        }
+
+        //Called from the timer thread once a move has settled, keep it short
+        void onDone(void (*callback)(int position)){
+            _callback = callback;
+        }
+
+        bool isDone(){
+            return _state == SERVO_IDLE;
+        }
+
+        int state(){
+            return _state;
+        }
+
+        int position(){
+            return _position;
+        }
+
+        int target(){
+            return _target;
+        }
+};
+
+#endif  //_SERVOACTUATOR_DS_
@@ -0,0 +1,151 @@
+#ifndef _STATEMACHINE_DS_
+#define _STATEMACHINE_DS_
+
+const int STATE_EVENT_QUEUE = 12;   //events waiting to be dispatched
+const int STATE_RESERVED = 4;       //of those, slots only postUrgent() can use
+const uint8_t STATE_STAY = 0xFF;    //next state for a transition that only runs its action
+
+//One row of a transition table - in state, on event, if guard (or no guard), run
+//  action and go to next. The first row that matches wins, so put guarded rows first.
+struct StateTransition{
+    uint8_t state;
+    uint8_t event;
+    uint8_t next;
+    bool (*guard)();
+    void (*action)();
+};
+
+//Run on the way into and out of a state, indexed by state
+struct StateActions{
+    void (*entry)();
+    void (*exit)();
+};
+
+//Table driven state machine
+//  Events are queued with post() and handled in order by dispatch(). Actions can post
+//  more events, they're handled after the current one finishes. Events that only say
+//  "look again" go in with postOnce(), so a backlog of them takes one slot. Events
+//  that can't be recreated go in with postUrgent(), which can use the reserved slots.
+class StateMachine{
+    const StateTransition *_table;
+    int _count;
+    const StateActions *_actions;
+    uint8_t _state;
+    uint8_t _events[STATE_EVENT_QUEUE];
+    unsigned int _head = 0;
+    unsigned int _tail = 0;
+    unsigned long _dropped = 0;
+
+    public:
+
+        template <int N>
+        StateMachine(const StateTransition (&table)[N], const StateActions *actions, uint8_t initial){
+            _table = table;
+            _count = N;
+            _actions = actions;
+            _state = initial;
+        }
+
+        //Run the first state's entry action, call once from setup()
+        void start(){
+            if(_actions[_state].entry){
+                _actions[_state].entry();
+            }
+        }
+
+        //Start in state instead of the initial one, to carry on after a reset
+        void start(uint8_t state){
+            _state = state;
+            start();
+        }
+
+        //Queue an event, leaving the reserved slots free
+        void post(uint8_t event){
+            add(event, STATE_EVENT_QUEUE - STATE_RESERVED);
+        }
+
+        //Queue an event unless the same one is already waiting
+        void postOnce(uint8_t event){
+            if(!isWaiting(event)){
+                post(event);
+            }
+        }
+
+        //Queue an event that mustn't be lost, it can take a reserved slot
+        void postUrgent(uint8_t event){
+            add(event, STATE_EVENT_QUEUE);
+        }
+
+        bool isWaiting(uint8_t event){
+            for(unsigned int i=_tail; i!=_head; i++){
+                if(_events[i % STATE_EVENT_QUEUE] == event){
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        //Handle everything posted so far, true if the state changed
+        bool dispatch(){
+            uint8_t startState = _state;
+
+            while(_head != _tail){
+                uint8_t event = _events[_tail % STATE_EVENT_QUEUE];
+                _tail++;
+                handle(event);
+            }
+            return _state != startState;
+        }
+
+        uint8_t state(){
+            return _state;
+        }
+
+        //Events lost because the queue was full
+        unsigned long droppedEvents(){
+            return _dropped;
+        }
+
+    private:
+
+        void add(uint8_t event, unsigned int limit){
+            if(_head - _tail >= limit){
+                _dropped++;
+                return;
+            }
+            _events[_head % STATE_EVENT_QUEUE] = event;
+            _head++;
+        }
+
+        void handle(uint8_t event){
+            for(int i=0; i<_count; i++){
+                const StateTransition &row = _table[i];
+                if(row.state != _state || row.event != event){
+                    continue;
+                }
+                if(row.guard && !row.guard()){
+                    continue;
+                }
+                if(row.next == STATE_STAY){
+                    if(row.action){
+                        row.action();
+                    }
+                    return;
+                }
+                if(_actions[_state].exit){
+                    _actions[_state].exit();
+                }
+                if(row.action){
+                    row.action();
+                }
+                _state = row.next;
+                if(_actions[_state].entry){
+                    _actions[_state].entry();
+                }
+                return;
+            }
+            //no row for it - the event doesn't matter in this state
+        }
+};
+
+#endif  //_STATEMACHINE_DS_
@@ -1,19 +1,57 @@
 #ifndef _TIMER_DS_
 #define _TIMER_DS_
 
+//A timer that lives in a Scheduler's task pool, keeping IoTTimer's startTimer()/isFinished()
+//  Give it a callback or an event and it goes off from scheduler.run(), once or every msec,
+//  so nothing polls it and the cost of expiry doesn't depend on how many timers there are.
+//  Started with just a time it can still be polled like the old IoTTimer. It only holds the
+//  task's id, the task itself comes from the scheduler's fixed pool, so nothing is allocated.
 class IoTTimer {
+    Scheduler &_scheduler;
+    int _task;
     unsigned int _timerStart, _timerTarget;
 
     public:
 
+        IoTTimer(Scheduler &scheduler): _scheduler(scheduler){
+            _task = SCHED_NONE;
+            _timerStart = 0;
+            _timerTarget = 0;
+        }
+
+        //Polled, check isFinished()
         void startTimer(unsigned int msec){
+            stopTimer();
             _timerStart = millis();
             _timerTarget = msec;
-        }        
+        }
+
+        //Call callback msec from now, or every msec
+        void startTimer(unsigned int msec, void (*callback)(), bool isPeriodic = false){
+            startTimer(msec);
+            _task = isPeriodic ? _scheduler.every(msec, callback) : _scheduler.after(msec, callback);
+        }
+
+        //Hand event to post() msec from now, or every msec
+        void startTimer(unsigned int msec, void (*post)(int event), int event, bool isPeriodic = false){
+            startTimer(msec);
+            _task = isPeriodic ? _scheduler.every(msec, post, event) : _scheduler.after(msec, post, event);
+        }
+
+        //Safe whether it's running, already went off or was never started
+        void stopTimer(){
+            _scheduler.cancel(_task);
+            _task = SCHED_NONE;
+        }
+
+        //True while a callback or event is still to come
+        bool isPending(){
+            return _scheduler.isPending(_task);
+        }
 
         bool isFinished(){
             return((millis()-_timerStart) >= _timerTarget);
         }
 };
 
-#endif  //_TIMER_DS_
\ No newline at end of file
+#endif  //_TIMER_DS_
@@ -0,0 +1,76 @@
+#ifndef _VACSTATES_DS_
+#define _VACSTATES_DS_
+
+#include "StateMachine_DS.h"
+
+//The vacuum's states and events, and how one leads to the other
+//  The actions live in Vacuum_ATM.cpp. Tools/HostTests drives this table on a PC with
+//  stand-ins for them.
+
+//Vacuum States
+const int CHARGING_NOT_DIRTY = 0; //red
+const int CHARGING_YES_DIRTY = 1; //green
+const int NOW_VACUUM_NO_REWARD = 2; //yellow
+const int NOW_VACUUM_REWARD_READY =3; //
+const int STOPPED_EARLY = 4;
+const int FINISHED_TAKE_REWARD = 5;
+const char * const VAC_STATE_STRING[6] = {"Charging, not dirty.", "Charging, dirty", "Vacuuming, reward not ready",
+                                    "Vacuuming, reward ready", "Stopped early", "Finished, take reward"};
+
+//Vacuum Events
+const int VAC_EV_DIRTY = 0;       //dust or days since vacuuming over the limit
+const int VAC_EV_DUST = 1;        //new dust reading
+const int VAC_EV_REMOVED = 2;     //vacuum left the charger
+const int VAC_EV_RETURNED = 3;    //vacuum back on the charger
+const int VAC_EV_TICK = 4;        //once a second
+const int VAC_EV_TIMEOUT = 5;     //the state timeout ran out
+const int VAC_EV_CAM_PRESSED = 6;
+const int VAC_EV_CAM_RELEASED = 7;
+
+//State machine actions, guards and LED pictures
+void enterNotDirty();
+void enterDirty();
+void enterVacuuming();
+void enterRewardReady();
+void enterStoppedEarly();
+void enterTakeReward();
+void exitTakeReward();
+void showDustRing();
+void showVacProgress();
+void updateVacProgress();
+bool isVacDone();
+void rewardEarned();
+void stoppedEarly();
+void openDoor();
+void armStateTimer(int msec);
+void disarmStateTimer();
+
+//What each event does in each state, anything not listed is ignored
+constexpr StateTransition VAC_TRANSITIONS[] = {
+    //state                    event                 next                     guard      action
+    {CHARGING_NOT_DIRTY,       VAC_EV_DIRTY,         CHARGING_YES_DIRTY,      NULL,      NULL},
+    {CHARGING_NOT_DIRTY,       VAC_EV_DUST,          STATE_STAY,              NULL,      showDustRing},
+    {CHARGING_YES_DIRTY,       VAC_EV_REMOVED,       NOW_VACUUM_NO_REWARD,    NULL,      NULL},
+    {NOW_VACUUM_NO_REWARD,     VAC_EV_TICK,          STATE_STAY,              NULL,      updateVacProgress},
+    {NOW_VACUUM_NO_REWARD,     VAC_EV_TIMEOUT,       NOW_VACUUM_REWARD_READY, NULL,      NULL},
+    {NOW_VACUUM_NO_REWARD,     VAC_EV_RETURNED,      FINISHED_TAKE_REWARD,    isVacDone, rewardEarned},
+    {NOW_VACUUM_NO_REWARD,     VAC_EV_RETURNED,      STOPPED_EARLY,           NULL,      stoppedEarly},
+    {NOW_VACUUM_REWARD_READY,  VAC_EV_RETURNED,      FINISHED_TAKE_REWARD,    isVacDone, rewardEarned},
+    {NOW_VACUUM_REWARD_READY,  VAC_EV_RETURNED,      STOPPED_EARLY,           NULL,      stoppedEarly},
+    {STOPPED_EARLY,            VAC_EV_TIMEOUT,       CHARGING_YES_DIRTY,      NULL,      NULL},
+    {STOPPED_EARLY,            VAC_EV_REMOVED,       NOW_VACUUM_NO_REWARD,    NULL,      NULL},
+    {FINISHED_TAKE_REWARD,     VAC_EV_CAM_PRESSED,   STATE_STAY,              NULL,      openDoor},
+    {FINISHED_TAKE_REWARD,     VAC_EV_CAM_RELEASED,  CHARGING_NOT_DIRTY,      NULL,      NULL},
+};
+
+//Entry and exit actions, in state order
+constexpr StateActions VAC_STATE_ACTIONS[6] = {
+    {enterNotDirty,       NULL},            //CHARGING_NOT_DIRTY
+    {enterDirty,          NULL},            //CHARGING_YES_DIRTY
+    {enterVacuuming,      disarmStateTimer},//NOW_VACUUM_NO_REWARD
+    {enterRewardReady,    NULL},            //NOW_VACUUM_REWARD_READY
+    {enterStoppedEarly,   disarmStateTimer},//STOPPED_EARLY
+    {enterTakeReward,     exitTakeReward},  //FINISHED_TAKE_REWARD
+};
+
+#endif  //_VACSTATES_DS_
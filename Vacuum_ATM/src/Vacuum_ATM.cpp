@@ -13,11 +13,24 @@
 #include "credentials.h"
 #include <neopixel.h>
 #include "Button_DS.h"
+#include "DockEvent_DS.h"
+#include "ServoActuator_DS.h"
+#include "StateMachine_DS.h"
+#include "VacStates_DS.h"
+#include "LogStore_DS.h"
+#include "RetainedBlock_DS.h"
+#include "DustSeries_DS.h"
+#include "DustForecast_DS.h"
+#include "LoopProfiler_DS.h"
+#include "Supervisor_DS.h"
+#include "Scheduler_DS.h"
 #include "Timer_DS.h"
+#include "DeferredLog_DS.h"
 
 
 SYSTEM_MODE(AUTOMATIC);
 SYSTEM_THREAD(ENABLED);
+STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY));
 
 const int PIXEL_COUNT = 33;
 const int RING_PIXEL_MIN = 1;   //first pixel to light on ring
@@ -25,6 +38,10 @@ const int RING_PIXEL_MAX = 15;
 const int STRIP_PIXEL_MIN = 16; //first pixel on strip
 const int STRIP_PIXEL_MAX = 33; //last pixel on strip
 const int PUBLISH_TIME = 30000;
+const int AIO_PUBLISH_PER_MIN = 20;   //Adafruit IO allows 30/min per account, Vacuum_Status gets the rest
+const int AIO_PUBLISH_BURST = 3;
+const int DUST_PUBLISH_PER_MIN = 4;   //totaldust only needs its newest value, coalesce the rest
+const int DIAG_PUBLISH_TIME = 900000; //MQTT health summary every 15 min
 const int RED = 0xFF0000;     //not ready to vacuum
 const int REDDISH_RING = 0x991100;
 const int REDDISH_STRIP = 0xFF2200;
@@ -39,48 +56,106 @@ const int BASELINE_BRIGHTNESS = 50;
 const int SERVO_PIN = A5;
 const int SERVO_CLOSED = 140; //door is closed
 const int SERVO_OPEN = 10;
+const int SERVO_MOVE_TIME = 400;    //ms to ease the door open or shut
 const int CAM_PIN = D3;     //changed from D18 - my PCB is weird and D18 is connected to A5. BAD!
 const int VAC_PIN = A2;
 
-//Vacuum States
+//Vacuum States, the states, events and transition table are in VacStates_DS.h
 int vacuumState;
 int lastVacuumState;
-const int CHARGING_NOT_DIRTY = 0; //red
-const int CHARGING_YES_DIRTY = 1; //green
-const int NOW_VACUUM_NO_REWARD = 2; //yellow
-const int NOW_VACUUM_REWARD_READY =3; //
-const int STOPPED_EARLY = 4;
-const int FINISHED_TAKE_REWARD = 5;
-const String VAC_STATE_STRING[6] = {"Charging, not dirty.", "Charging, dirty", "Vacuuming, reward not ready",
-                                    "Vacuuming, reward ready", "Stopped early", "Finished, take reward"};
+
+//Profiled parts of the loop
+const int PROF_CONNECT = 0;
+const int PROF_PING = 1;
+const int PROF_OUTBOX = 2;
+const int PROF_SCHEDULER = 3;     //everything the scheduler runs - ticks, checkpoints, diagnostics
+const int PROF_SUBSCRIPTIONS = 4;
+const int PROF_STATE_MACHINE = 5;
+const char * const PROFILE_NAMES[6] = {"connect", "ping", "outbox", "timers", "subs", "states"};
+
+//Heartbeat deadlines - connecting can legitimately take a while, the rest wait behind it
+const int NETWORK_DEADLINE = 120000;
+const int INPUTS_DEADLINE = 150000;
+const int STATES_DEADLINE = 150000;
+
+const int CLOUD_CONNECT_WAIT = 60000;   //longest setup() waits for the cloud, well inside NETWORK_DEADLINE
+const int TICK_TIME = 1000;
+const int STOPPED_EARLY_TIME = 2000;    //how long to show stopped early
+const int DATA_LED_TIME = 500;          //onboard LED flash when data comes in
+const int SUBSCRIPTION_WAIT = 100;      //longest wait for MQTT data each loop
+
 int vacStartTime;
+int vacSessionTime = 0;     //time off the charger for the last trip, by Vacuum_Status's clock
 int elapsedVacTime=0;   //total time spent vacuuming
 int prevVacTime = 0;    //previous total time vacuuming
 int lastVacStateTime;   //last time the vacuum state changed
-bool isReadyToDispense = false; //After vacuum is returned & has been used enough set true
 bool isVacCharging;
 bool lastVacChargeState;
 unsigned int timeSinceVacuumed;
-bool isVacReturned = 0;
-bool isVacRemoved = 0;
+unsigned long lastDockSeq = 0;    //sequence number of the last dock event, 0 until the first one
+unsigned long dockEventsMissed = 0;
+unsigned long dockEventsRepeated = 0;
+uint64_t vacRemovedTimeMs = 0;    //when the vacuum left the charger, 0 if we don't know
 
 
 const int VACUUMING_TIME = 600000;   //900,000 is 15 min, 600,000 = 10 min
 const int MAX_DUST = 3000000;       //3,500,000 - roughly 1 week @500 particles/15 min 
 const int MAX_TIME_SINCE_VAC = 1209600;            //time in seconds - 1,209,600sec = 14 days
+const int MAX_EVENT_AGE = 86400000;     //don't back date a dock event more than a day
 
 //EEPROM Setup
 int len = EEPROM.length();
-int totalDustAddress = 0x0001; //4 bytes from 0x0001 to 0x0004
-int timeAddress = 0x0010;   //
+int totalDustAddress = 0x0001; //old home of totalDust, only read once to move it into the store
+int timeAddress = 0x0010;   //old home of previousUnixTime, same
+const int OUTBOX_ADDRESS = 0x0100;  //publishes waiting for MQTT to come back, 242 bytes
+const int STORE_ADDRESS = 0x0200;   //LogStore region, 128 records
+const int STORE_LENGTH = 0x0600;
+const int CHECKPOINT_TIME = 1800000;   //copy the counters to the store every 30 min, power loss costs that much
+const int CHECKPOINT_DUST = 200000;    //or sooner if dust goes up by about one ring LED
+const int STORE_TOTAL_DUST = 0;     //LogStore keys - totalDust
+const int STORE_LAST_VAC_UNIX = 1;  //previousUnixTime, when the last vacuum finished
+const int STORE_PREV_VAC_TIME = 2;  //prevVacTime, ms vacuumed so far this session
+const int DUST_SERIES_ADDRESS = 0x0800;     //dust history, 16 blocks of 128 bytes to the end of EEPROM
+const int DUST_HISTORY_BUCKETS = 48;        //most buckets one dustHistory call can ask for
 
 bool isLEDOn = false;
+char mqttDiagnostics[96];  //also readable as the mqttStats cloud variable
+char storeStats[64];       //EEPROM wear, the storeStats cloud variable
+char loopStats[160];       //loop timing for the last diagnostics window, the loopStats cloud variable
+char schedStats[96];       //scheduler and event queue counters, the schedStats cloud variable
+char loopSummary[80];      //the short form of it that goes to the loop diagnostics feed
+char dirtyForecast[80];    //when it will be time to vacuum, the dirtyForecast cloud variable
+char dustHistory[864];     //answer to the last dustHistory call, the dustHistory cloud variable (864 is the most it can send)
 unsigned int totalDust = 0; //4 bytes - 
 float totalDustK = 0;
-int lastRXTime = 0;
 int ringLEDDustLevel = 0;
 int ringVacTimeLevel = 0;
 
+//Counters that have to survive a reset, kept in retained RAM and checkpointed to the store
+//  The session part (state, dock and trip start) only lives in retained RAM.
+struct VacCounters{
+    uint32_t totalDust;
+    int32_t elapsedVacTime;
+    int32_t prevVacTime;
+    uint32_t previousUnixTime;
+    uint64_t vacRemovedTimeMs;
+    uint32_t lastDockSeq;
+    uint8_t vacuumState;
+    uint8_t isVacCharging;
+};
+retained RetainedBlock<VacCounters> savedCounters;
+unsigned int checkpointDust = 0;    //totalDust at the last checkpoint
+
+//Which task stopped the watchdog being fed, kept through the reset that follows
+struct HangRecord{
+    char task[16];
+    uint32_t lateMs;
+    uint32_t time;
+};
+retained RetainedBlock<HangRecord> lastHang;
+char lastHangText[48];     //the lastHang cloud variable
+int networkTask, inputsTask, statesTask;
+
 //Time
 unsigned int previousUnixTime;
 unsigned int currentUnixTime;
@@ -91,39 +166,81 @@ time32_t now();
 void MQTT_connect();
 bool MQTT_ping();
 void getNewDustData();
+void handleDockEvent(DockEvent event);
 void adaPublish();
 void dustToBytes(int dustIn, byte *dustHOut, byte *dustMOut, byte *dustLOut);
-void newDataLEDFlash();
+void flashDataLED();
+void dataLEDOff();
+void onTick();
+void postVacEvent(int event);
 void fillLEDs(int ledColor, int startLED=0, int lastLED=PIXEL_COUNT);
 void breatheLEDs(int ledColor, int startLED=0, int lastLED=PIXEL_COUNT);
 void checkLEDs(int ledColor, int startLED, int lastLED);
 void moveServo(int position);
 void periodicPrint();
+void publishDiagnostics();
+void loadStore();
+int queryDustHistory(String command);
+void updateForecast();
+void loadCounters();
+void retainCounters();
+void resumeSession();
+void recordHang(const char *task, unsigned int lateMs);
+void checkpointCounters();
+void checkDirty();
+
+StateMachine vacMachine(VAC_TRANSITIONS, VAC_STATE_ACTIONS, CHARGING_NOT_DIRTY);
 
 TCPClient TheClient;
 Adafruit_MQTT_SPARK mqtt(&TheClient, AIO_SERVER, AIO_SERVERPORT, AIO_USERNAME, AIO_KEY);
 Adafruit_MQTT_Subscribe dustSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/feeds/plantinfo.dustsensor");
-Adafruit_MQTT_Subscribe vacInfoSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/feeds/vacuumstatus");
+Adafruit_MQTT_Subscribe vacEventSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/feeds/vacuumevents");
 Adafruit_MQTT_Publish dustPub = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/totaldust");
+Adafruit_MQTT_Publish diagPub = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/diagnostics.vacuumatm");
+Adafruit_MQTT_Publish loopPub = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/diagnostics.vacuumatmloop");
+//the summary has to fit the packet buffer with its topic - up to 3 bytes of fixed header, 2 of topic length
+static_assert(5 + sizeof(AIO_USERNAME "/feeds/diagnostics.vacuumatmloop") - 1 + sizeof(loopSummary) - 1 <= MAXBUFFERSIZE,
+    "loopSummary and its topic don't fit the MQTT packet buffer");
+Adafruit_MQTT_Publish forecastPub = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/dirtyforecast");
+Adafruit_MQTT_Subscribe throttleSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/throttle");
+Adafruit_MQTT_Subscribe errorsSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/errors");
 
 // Timer publishTimer(PUBLISH_TIME, adaPublish);
 
 Adafruit_NeoPixel pixel(PIXEL_COUNT, SPI1, WS2812);
-Servo myServo;
+ServoActuator doorServo(SERVO_PIN);
+LogStore store(STORE_ADDRESS, STORE_LENGTH);     //written by checkpointCounters()
+DustSeries dustSeries(DUST_SERIES_ADDRESS);
+DustForecast dustForecast;
+LoopProfiler profiler(PROFILE_NAMES, 6);
+Supervisor supervisor;
+DeferredLog trace;      //everything printed goes through here, decode it with Tools/TraceDecode
 Button vacButton(VAC_PIN);
 Button camButton(CAM_PIN);
-IoTTimer flashTimer;
-IoTTimer servoTimer;
+Scheduler scheduler;    //all the loop's timing
+IoTTimer stateTimer(scheduler);     //the state machine's timeout
+IoTTimer flashTimer(scheduler);     //turns the data LED off again
 
 void setup() {
     Serial.begin(9600);
-    waitFor(Serial.isConnected, 10000);
+    trace.begin();      //holds the log until something connects, no need to wait for it
 
-    Watchdog.init(WatchdogConfiguration().timeout(600s));     //Set watchdog timer to 5 min
+    Watchdog.init(WatchdogConfiguration().timeout(60s));      //only fed while every task is keeping up
     Watchdog.start();                                         //Start watchdog timer
+    //tasks go in first, the watchdog isn't fed until something is beating
+    networkTask = supervisor.add("network", NETWORK_DEADLINE);
+    inputsTask = supervisor.add("inputs", INPUTS_DEADLINE);
+    statesTask = supervisor.add("states", STATES_DEADLINE);
+    supervisor.onMiss(recordHang);
+    supervisor.begin();
+    if(lastHang.isValid()){
+        snprintf(lastHangText, sizeof(lastHangText), "%s, %lus late at %lu", lastHang.data.task,
+            (unsigned long)(lastHang.data.lateMs / 1000), (unsigned long)lastHang.data.time);
+        trace.printf("Last hang: %s\n\n", lastHangText);
+    }
 
-    myServo.attach(SERVO_PIN);
-    moveServo(SERVO_CLOSED);
+    camButton.beginInterrupt();
+    doorServo.begin(SERVO_CLOSED);
     pixel.begin();
     pixel.setBrightness(BASELINE_BRIGHTNESS);
 
@@ -136,146 +253,236 @@ void setup() {
     pixel.show();
 
 
-    Serial.printf("Connecting to Particle cloud...");
-    while(!Particle.connected()){
-        //wait to connect to particle cloud
+    trace.printf("Connecting to Particle cloud...");
+    if(!waitFor(Particle.connected, CLOUD_CONNECT_WAIT)){
+        trace.printf(" not yet, carrying on\n");     //the system thread keeps trying
     }
 
-    previousUnixTime = EEPROM.get(timeAddress, previousUnixTime);
-    Serial.printf("PreviousTime: %u\n\n", previousUnixTime);
+    loadCounters();
+    dustSeries.forEach([](uint32_t time, int32_t dust){     //warm the forecast up on the saved history
+        dustForecast.add(time, dust);
+    });
+    trace.printf("PreviousTime: %u\n\n", previousUnixTime);
 
-
-    totalDust = EEPROM.get(totalDustAddress, totalDust);
     ringLEDDustLevel = map(totalDust, 0, MAX_DUST, RING_PIXEL_MAX, RING_PIXEL_MIN);
     ringLEDDustLevel = constrain(ringLEDDustLevel, RING_PIXEL_MIN, RING_PIXEL_MAX);
     fillLEDs(0x330000, RING_PIXEL_MIN, ringLEDDustLevel);
     pixel.show();
     // publishTimer.start();
 
+    mqtt.setOutboxStorage(OUTBOX_ADDRESS);
+    dustPub.setLatestValue(true);     //only the newest total matters after an outage
+    dustPub.setRateLimit(DUST_PUBLISH_PER_MIN);
+    mqtt.setRateLimit(AIO_PUBLISH_PER_MIN, AIO_PUBLISH_BURST);
+    mqtt.watchThrottle(&throttleSub, &errorsSub);
+    diagPub.setLatestValue(true);
+    forecastPub.setLatestValue(true);
+    loopPub.setLatestValue(true);
+    Particle.variable("loopStats", loopStats);
+    Particle.variable("schedStats", schedStats);
+    Particle.variable("lastHang", lastHangText);
+    Particle.variable("dirtyForecast", dirtyForecast);
+    Particle.variable("mqttStats", mqttDiagnostics);
+    Particle.variable("storeStats", storeStats);
+    Particle.variable("dustHistory", dustHistory);
+    Particle.function("dustHistory", queryDustHistory);
+#ifdef LAN_MQTT_SERVER
+    //Prefer the broker on the LAN, Adafruit IO takes over while it's down
+    mqtt.addBroker(LAN_MQTT_SERVER, LAN_MQTT_PORT, LAN_MQTT_USERNAME, LAN_MQTT_KEY, true);
+#endif
+    vacEventSub.fetchOnSubscribe(true);   //learn the dock state right away after a reboot
     mqtt.subscribe(&dustSub);
-    mqtt.subscribe(&vacInfoSub);
+    mqtt.subscribe(&vacEventSub);
 
     pinMode(7, OUTPUT);
     digitalWrite(7, LOW);
 
+    scheduler.begin();      //before resumeSession(), it can arm the state timeout
+    resumeSession();
+    scheduler.every(TICK_TIME, onTick);
+    scheduler.every(DIAG_PUBLISH_TIME, publishDiagnostics);
+    scheduler.every(CHECKPOINT_TIME, checkpointCounters);
 }
 
 void loop() {
-  Watchdog.refresh();
-    MQTT_connect();
-    MQTT_ping();
+    const char *missedTask;
+    unsigned int missedMs;
 
-    currentUnixTime = Time.now();
-    timeSinceVacuumed = currentUnixTime - previousUnixTime;
+    profiler.loopStart();
+    if(supervisor.takeMiss(&missedTask, &missedMs)){
+        trace.printf("### %s missed its heartbeat, %ums since the last one ###\n", missedTask, missedMs);
+    }
+    {ProfileScope scope(profiler, PROF_CONNECT); MQTT_connect();}
+    {ProfileScope scope(profiler, PROF_PING); MQTT_ping();}
+    supervisor.beat(networkTask);
+    {ProfileScope scope(profiler, PROF_OUTBOX); mqtt.flushOutbox();}    //send publishes the rate limiter held back
+    {ProfileScope scope(profiler, PROF_SCHEDULER); scheduler.run();}    //ticks, timeouts, checkpoints, diagnostics
 
+    // periodicPrint();
+    {ProfileScope scope(profiler, PROF_SUBSCRIPTIONS); getNewDustData();}   //posts dust and dock events
+    ProfileScope scope(profiler, PROF_STATE_MACHINE);
+
+    //Turn the buttons into events, then let the state machine do the work
+    //Cam edges are queued by an interrupt, so a turn while the loop is busy isn't lost
+    ButtonEvent camEvent;
+    while(camButton.getEvent(&camEvent)){
+        vacMachine.post(camEvent.pressed ? VAC_EV_CAM_PRESSED : VAC_EV_CAM_RELEASED);
+    }
+    supervisor.beat(inputsTask);
+    vacMachine.dispatch();
+    supervisor.beat(statesTask);       //LEDs and the door are driven from here
+
+    vacuumState = vacMachine.state();
     if(vacuumState != lastVacuumState){
-        Serial.printf("New Vacuum State:\n  %s\n\n", VAC_STATE_STRING[vacuumState].c_str());
+        trace.printf("New Vacuum State:\n  %s\n\n", VAC_STATE_STRING[vacuumState]);
         lastVacStateTime = millis();    //track when state changes
         lastVacuumState = vacuumState;
+        retainCounters();
     }
+}
 
-    // periodicPrint();
-    getNewDustData();
-    newDataLEDFlash();
-
-
-  ////Treat button like real vacuum
-  ////  pressed = vacuum on charger
-  ////  released = taking off charger
-  ////  not pressed = vacuuming
-  ////  clicked = putting back on charger
-  //
-  //If the house is dirty or it has been too long...
-  if((totalDust > MAX_DUST) || (timeSinceVacuumed>MAX_TIME_SINCE_VAC)){
-    ringVacTimeLevel = map(elapsedVacTime, 0, VACUUMING_TIME, RING_PIXEL_MAX, RING_PIXEL_MIN);
-    ringVacTimeLevel = constrain(ringVacTimeLevel, RING_PIXEL_MIN, RING_PIXEL_MAX);
-    fillLEDs(REDDISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
-    fillLEDs(GREENISH_RING, ringVacTimeLevel, RING_PIXEL_MAX);
-    fillLEDs(REDDISH_STRIP, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
+//Post a dirty event while the house is dirty or it has been too long
+void checkDirty(){
+    currentUnixTime = Time.now();
+    timeSinceVacuumed = currentUnixTime - previousUnixTime;
+    if((totalDust > MAX_DUST) || (timeSinceVacuumed>MAX_TIME_SINCE_VAC)){
+        vacMachine.postOnce(VAC_EV_DIRTY);
+    }
+}
 
-    // fillLEDs(REDDISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
-    // fillLEDs(REDDISH_STRIP, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
-    vacuumState = CHARGING_YES_DIRTY;
+void onTick(){
+    checkDirty();
+    vacMachine.postOnce(VAC_EV_TICK);
+}
 
+void armStateTimer(int msec){
+    stateTimer.startTimer(max(msec, 0), postVacEvent, VAC_EV_TIMEOUT);
+}
 
-    if(isVacRemoved){      //When vacuum removed
-      vacStartTime = millis();        //set the start vacuum timer 
-      isVacRemoved = false;
+//Cancelling a timeout that already went off is harmless, its id has gone stale
+void disarmStateTimer(){
+    stateTimer.stopTimer();
+}
+
+//Scheduled events fire once, they can't be posted again if they're lost
+void postVacEvent(int event){
+    vacMachine.postUrgent(event);
+}
+
+////State machine actions////
+////Treat button like real vacuum
+////  pressed = vacuum on charger
+////  released = taking off charger
+////  not pressed = vacuuming
+////  clicked = putting back on charger
+
+void enterNotDirty(){
+    showDustRing();
+}
+
+//The house got dirty, or we came back from stopping early
+void enterDirty(){
+    showVacProgress();
+    if(lastDockSeq != 0 && !isVacCharging){
+        vacMachine.postUrgent(VAC_EV_REMOVED);    //it was already out when the house got dirty
     }
-    //if you are vacuuming
-    if(!isVacCharging){
-      elapsedVacTime = prevVacTime+ (millis() - vacStartTime);
-      // ringVacTimeLevel = map(elapsedVacTime, 0, VACUUMING_TIME, RING_PIXEL_MAX, RING_PIXEL_MIN);
-      // ringVacTimeLevel = constrain(ringVacTimeLevel, RING_PIXEL_MIN, RING_PIXEL_MAX);
-      if(elapsedVacTime > VACUUMING_TIME){  //check if you have vacuumed long enough
-        fillLEDs(GREENISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
-        fillLEDs(0, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
-        vacuumState = NOW_VACUUM_REWARD_READY;
-      } else{
-        // fillLEDs(REDDISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
-        // fillLEDs(0x553300, ringVacTimeLevel, RING_PIXEL_MAX);
-        // fillLEDs(REDDISH_STRIP, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
-        vacuumState = NOW_VACUUM_NO_REWARD;
-      }
-    }
-    //If the vacuum is returned
-    if(isVacReturned){         
-      isVacReturned = false;
-      if(elapsedVacTime > VACUUMING_TIME){  //check if you have vacuumed enough
-        totalDust =0;
-        totalDustK = 0;
-        timeSinceVacuumed = 0;
-        elapsedVacTime =0;
-        prevVacTime = 0;
-        previousUnixTime = currentUnixTime;
-        EEPROM.put(timeAddress, currentUnixTime);   //log last vacuum time in EEPROM
-        vacuumState = FINISHED_TAKE_REWARD;
-        isReadyToDispense = true;
-      }else{
-        isReadyToDispense = false;
-        prevVacTime = elapsedVacTime;
-        vacuumState = STOPPED_EARLY;
-        flashTimer.startTimer(2000);
-      }
-    }
-  }else{    //If the house is not dirty enough
+}
 
+//Time out when the reward is earned, counting time from earlier trips
+void enterVacuuming(){
+    elapsedVacTime = prevVacTime + (millis() - vacStartTime);
+    armStateTimer(VACUUMING_TIME - elapsedVacTime);
+    showVacProgress();
+}
+
+void enterRewardReady(){
+    fillLEDs(GREENISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
+    fillLEDs(0, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
+    pixel.show();
+}
+
+void enterStoppedEarly(){
+    armStateTimer(STOPPED_EARLY_TIME);
+    showVacProgress();
+}
+
+void enterTakeReward(){
+    fillLEDs(0x443322, RING_PIXEL_MIN, RING_PIXEL_MAX);
+    fillLEDs(0, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
+    pixel.show();
+}
+
+//However we leave, the door ends up shut
+void exitTakeReward(){
+    moveServo(SERVO_CLOSED);
+    pixel.clear();
+}
+
+void showDustRing(){
     pixel.clear();
     fillLEDs(0x553300, RING_PIXEL_MIN, RING_PIXEL_MAX);
     fillLEDs(REDDISH_RING, ringLEDDustLevel, RING_PIXEL_MAX);
-    vacuumState = CHARGING_NOT_DIRTY;
-  }
+    pixel.show();
+}
 
-if(isReadyToDispense){
-  fillLEDs(0x443322, RING_PIXEL_MIN, RING_PIXEL_MAX);
-  fillLEDs(0, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
-  if(camButton.isClicked()){
-    moveServo(SERVO_OPEN);
-    Serial.printf("Door opening - cam clicked\n");
-  } else if (camButton.isReleased()){
-    isReadyToDispense = false;
-    moveServo(SERVO_CLOSED);
+//Ring fills green as the vacuuming time adds up
+void showVacProgress(){
+    ringVacTimeLevel = map(elapsedVacTime, 0, VACUUMING_TIME, RING_PIXEL_MAX, RING_PIXEL_MIN);
+    ringVacTimeLevel = constrain(ringVacTimeLevel, RING_PIXEL_MIN, RING_PIXEL_MAX);
+    fillLEDs(REDDISH_RING, RING_PIXEL_MIN, RING_PIXEL_MAX);
+    fillLEDs(GREENISH_RING, ringVacTimeLevel, RING_PIXEL_MAX);
+    fillLEDs(REDDISH_STRIP, STRIP_PIXEL_MIN, STRIP_PIXEL_MAX);
+    pixel.show();
+}
+
+void updateVacProgress(){
+    elapsedVacTime = prevVacTime + (millis() - vacStartTime);
+    retainCounters();
+    showVacProgress();
+}
+
+//Has the trip that just ended, with the ones before it, been long enough?
+bool isVacDone(){
+    return prevVacTime + vacSessionTime > VACUUMING_TIME;
+}
+
+void rewardEarned(){
+    totalDust =0;
+    totalDustK = 0;
+    timeSinceVacuumed = 0;
+    elapsedVacTime =0;
+    prevVacTime = 0;
     ringLEDDustLevel = RING_PIXEL_MAX;
-    pixel.clear();
-  }
+    currentUnixTime = Time.now();
+    previousUnixTime = currentUnixTime;
+    retainCounters();
+    checkpointCounters();   //don't wait, losing power now would take the reward back
 }
 
-    pixel.show();
+void stoppedEarly(){
+    elapsedVacTime = prevVacTime + vacSessionTime;
+    prevVacTime = elapsedVacTime;
+    retainCounters();
 }
 
+void openDoor(){
+    moveServo(SERVO_OPEN);
+    trace.printf("Door opening - cam clicked\n");
+}
+
+//Start the door moving and carry on - doorServo eases it there and detaches on its own
 void moveServo(int position){
     position = constrain(position, 0, 180);
-    myServo.write(position);
-    delay(500);
-    // Serial.printf("!!!!!!!MOVING SERVO: %i!!!!!!!\n!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n\n", position);
+    doorServo.moveTo(position, SERVO_MOVE_TIME);
+    // trace.printf("!!!!!!!MOVING SERVO: %i!!!!!!!\n!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n\n", position);
 }
 
 void periodicPrint(){
   static int lastPrintTime;
 
   if(millis()-lastPrintTime > 1000){
-        // Serial.printf("Dust: %i\nTime: %i\nTotal Vac time: %i\n", totalDust, timeSinceVacuumed,elapsedVacTime);
-        Serial.printf("CamButton: %i\n\n", camButton.isPressed());
+        // trace.printf("Dust: %i\nTime: %i\nTotal Vac time: %i\n", totalDust, timeSinceVacuumed,elapsedVacTime);
+        trace.printf("CamButton: %i\n\n", camButton.isPressed());
         lastPrintTime = millis();
     }
 }
@@ -304,37 +511,48 @@ void checkLEDs(int ledColor, int startLED, int lastLED){
 //Wait for new dust data and save it to the EEPROM
 void getNewDustData(){
     int incomingDust;
-    String incomingVacInfo;
 
     Adafruit_MQTT_Subscribe *subscription;
-    while((subscription = mqtt.readSubscription(100))){
+    //wait for data until the next scheduled task is due
+    while((subscription = mqtt.readSubscription(scheduler.msUntilNext(SUBSCRIPTION_WAIT)))){
         if(subscription == &dustSub){
             incomingDust = strtol((char *)dustSub.lastread,NULL,10);
-            Serial.printf("Int incoming dust: %i\n", incomingDust);
+            trace.printf("Int incoming dust: %i\n", incomingDust);
             totalDust = totalDust + incomingDust;
-            EEPROM.put(totalDustAddress, totalDust);
+            if(Time.isValid()){
+                dustSeries.add(Time.now(), incomingDust);
+                dustForecast.add(Time.now(), incomingDust);
+            }
+            retainCounters();
+            if(totalDust - checkpointDust >= CHECKPOINT_DUST){
+                checkpointCounters();   //a big change is worth a write before the next scheduled one
+            }
+            updateForecast();
 
             ringLEDDustLevel = map(totalDust, 0, MAX_DUST, RING_PIXEL_MAX, RING_PIXEL_MIN);
             ringLEDDustLevel = constrain(ringLEDDustLevel, RING_PIXEL_MIN, RING_PIXEL_MAX);
-            Serial.printf("Ring LED #%i\n\n", ringLEDDustLevel);
+            trace.printf("Ring LED #%i\n\n", ringLEDDustLevel);
             totalDustK = totalDust / 1000.0;    //divide by 1,000 for nicer visualization
-            lastRXTime = millis();
-            Serial.printf("%0.2fk Total Dust Particles\n\n", totalDustK);
+            flashDataLED();
+            trace.printf("%0.2fk Total Dust Particles\n\n", totalDustK);
             adaPublish();
-        } else if (subscription == &vacInfoSub){
-            lastRXTime = millis();
-            incomingStateChangeTime = Time.now();
-            incomingVacInfo = (char *)vacInfoSub.lastread;
-            isVacCharging = atoi(incomingVacInfo);
-            
-            //VacStatus Photon only sends chargin/not charging on state change
-            //  so we can assume the below are the rising/falling edge of state change
-            isVacReturned = isVacCharging;
-            isVacRemoved = !isVacCharging;
-
-            Serial.printf("### vac info incoming ###\n");
-            Serial.printf("isVacCharging: %i\n", isVacCharging);
-            Serial.printf("Last Vac state change time: %u\n\n", incomingStateChangeTime);
+            vacMachine.postOnce(VAC_EV_DUST);
+            checkDirty();
+        } else if (subscription == &vacEventSub){
+            DockEvent event;
+            if(!unpackDockEvent(vacEventSub.payload().data, vacEventSub.payload().len, &event)){
+                trace.printf("Not a dock event: %i bytes\n\n", vacEventSub.payload().len);
+                continue;
+            }
+            flashDataLED();
+            handleDockEvent(event);
+        } else if (subscription == &throttleSub || subscription == &errorsSub){
+            //notices are longer than lastread, print them from the packet buffer
+            char notice[TRACE_MAX_STRING + 1];
+            int len = min((int)subscription->payload().len, TRACE_MAX_STRING);
+            memcpy(notice, subscription->payload().data, len);
+            notice[len] = 0;
+            trace.printf("Adafruit IO: %s\n\n", notice);
         }
     }
 
@@ -342,23 +560,213 @@ void getNewDustData(){
 
 }
 
+//Apply a dock event from Vacuum_Status
+//  Times the vacuum by when it left and came back on Vacuum_Status's clock, so a slow
+//  or stalled connection doesn't change the time. Sequence numbers catch repeats and gaps.
+void handleDockEvent(DockEvent event){
+    uint64_t nowMs = epochMillis();
+    int eventAge = 0;
+    bool wasCharging = isVacCharging;
+    bool isFirst = (lastDockSeq == 0);
+
+    //Vacuum_Status starts again from 1 if its EEPROM gets wiped
+    if(!isFirst && event.seq <= lastDockSeq && !(event.seq == 1 && lastDockSeq > 1)){
+        dockEventsRepeated++;
+        trace.printf("### repeated dock event #%lu ignored ###\n\n", event.seq);
+        return;
+    }
+    bool isGap = !isFirst && event.seq > lastDockSeq + 1;
+    if(isGap){
+        dockEventsMissed = dockEventsMissed + (event.seq - lastDockSeq - 1);
+        trace.printf("### missed %lu dock events, %lu so far ###\n", event.seq - lastDockSeq - 1, dockEventsMissed);
+    }
+    lastDockSeq = event.seq;
 
-//Flash onboard LED when new data comes in
-void newDataLEDFlash(){
-    if(millis() - lastRXTime <500){
-        digitalWrite(7, HIGH);  
-    } else{
-        digitalWrite(7, LOW);
+    if(event.timeMs != 0 && nowMs > event.timeMs){
+        eventAge = min(nowMs - event.timeMs, (uint64_t)MAX_EVENT_AGE);
     }
+    if(event.timeMs == 0){      //Vacuum_Status didn't know the time yet, use when it got here
+        event.timeMs = nowMs;
+    }
+    incomingStateChangeTime = event.timeMs / 1000;
+    isVacCharging = event.state;
+
+    if(isFirst){
+        //Nothing to compare with after a reboot - only tells us where the vacuum is
+        trace.printf("### vac state restored ###\n");
+    }
+    if(!isVacCharging){
+        //A new trip, or we lost track of the last one and start counting again
+        if(isFirst || wasCharging || isGap){
+            vacRemovedTimeMs = event.timeMs;
+            vacStartTime = millis() - eventAge;
+            vacMachine.postUrgent(VAC_EV_REMOVED);
+        }
+    } else if(!isFirst && !wasCharging){
+        if(isGap){
+            vacSessionTime = 0;     //we missed part of this trip, can't say how long it was out
+        } else if(vacRemovedTimeMs != 0 && event.timeMs != 0){
+            vacSessionTime = event.timeMs - vacRemovedTimeMs;
+        } else{
+            vacSessionTime = millis() - vacStartTime;   //no clock on either side, go by arrival
+        }
+        vacMachine.postUrgent(VAC_EV_RETURNED);
+    }
+
+    trace.printf("### vac event #%lu incoming ###\n", event.seq);
+    trace.printf("isVacCharging: %i, %ims ago\n", isVacCharging, eventAge);
+    trace.printf("Last Vac state change time: %u\n\n", incomingStateChangeTime);
+    retainCounters();
+}
+
+
+//Flash onboard LED when new data comes in
+void flashDataLED(){
+    digitalWrite(7, HIGH);
+    flashTimer.startTimer(DATA_LED_TIME, dataLEDOff);
+}
+
+void dataLEDOff(){
+    digitalWrite(7, LOW);
 }
 
 //Publish to Adafruit.io - dust is divided by 1,000 for legibility
+//  If MQTT is down this goes into the outbox and is sent after reconnecting
 void adaPublish(){
-  if(mqtt.Update()){
-    dustPub.publish(totalDustK);
+  if(!dustPub.publish(totalDustK)){
+    trace.printf("Publish deferred: %i queued, %i%% of rate limit used\n", mqtt.outboxDepth(), mqtt.rateLimitUsage());
   }
 }
 
+//Summarize MQTT health for the diagnostics feed and the mqttStats cloud variable
+void publishDiagnostics(){
+    Adafruit_MQTT_Metrics stats;
+    unsigned long packetsIn = 0;
+    unsigned long packetsOut = 0;
+
+    mqtt.metrics(&stats);
+    for(int i=0; i<16; i++){
+        packetsIn = packetsIn + stats.packets_in[i];
+        packetsOut = packetsOut + stats.packets_out[i];
+    }
+    snprintf(mqttDiagnostics, sizeof(mqttDiagnostics), "rx %lu/%lu tx %lu/%lu drop %lu trunc %lu recon %lu ping %lu rtt %lu conn %lu",
+        packetsIn, stats.bytes_in, packetsOut, stats.bytes_out, stats.dropped, stats.truncated,
+        stats.reconnects, stats.reconnect_causes[MQTT_CAUSE_PING], mqtt.pingRTT(), stats.connect_ms.max);
+
+    snprintf(storeStats, sizeof(storeStats), "wa %lu%% flash %luB life %lud bad %lu",
+        store.writeAmplification(), store.flashBytes(), store.lifetimeDays(), store.badRecords());
+
+    //diagnostics can wait, don't spend rate limit the real data needs
+    if(mqtt.connected() && mqtt.rateLimitUsage() < 50){
+        diagPub.publish(mqttDiagnostics);
+    }
+    profiler.report(loopStats, sizeof(loopStats), loopSummary, sizeof(loopSummary));
+    snprintf(schedStats, sizeof(schedStats), "timers %lu woke %lu idle %lu skipped %lu, events lost %lu",
+        scheduler.fired(), scheduler.wakeups(), scheduler.idleRuns(), scheduler.skipped(), vacMachine.droppedEvents());
+    trace.printf("Loop: %s\n%s\n\n", loopStats, schedStats);
+    if(mqtt.connected() && mqtt.rateLimitUsage() < 50){
+        loopPub.publish(loopSummary);       //the full report is too big for a publish
+    }
+}
+
+//Get the counters back after a reboot
+//  A reset leaves them in retained RAM, the store is only needed after losing power.
+void loadCounters(){
+    store.begin();
+    dustSeries.begin();
+    if(savedCounters.isValid()){
+        totalDust = savedCounters.data.totalDust;
+        elapsedVacTime = savedCounters.data.elapsedVacTime;
+        prevVacTime = savedCounters.data.prevVacTime;
+        previousUnixTime = savedCounters.data.previousUnixTime;
+        vacRemovedTimeMs = savedCounters.data.vacRemovedTimeMs;
+        lastDockSeq = savedCounters.data.lastDockSeq;
+        vacuumState = savedCounters.data.vacuumState;
+        isVacCharging = savedCounters.data.isVacCharging;
+        trace.printf("Counters kept in retained RAM\n");
+    } else{
+        loadStore();
+        retainCounters();
+    }
+    checkpointDust = totalDust;
+}
+
+//Copy the counters to retained RAM, cheap enough to do on every change
+void retainCounters(){
+    savedCounters.data.totalDust = totalDust;
+    savedCounters.data.elapsedVacTime = elapsedVacTime;
+    savedCounters.data.prevVacTime = prevVacTime;
+    savedCounters.data.previousUnixTime = previousUnixTime;
+    savedCounters.data.vacRemovedTimeMs = vacRemovedTimeMs;
+    savedCounters.data.lastDockSeq = lastDockSeq;
+    savedCounters.data.vacuumState = vacuumState;
+    savedCounters.data.isVacCharging = isVacCharging;
+    savedCounters.seal();
+}
+
+//Supervisor caught a task missing its heartbeat, the watchdog will reset us soon
+//  Runs in the timer thread, only touches retained RAM.
+void recordHang(const char *task, unsigned int lateMs){
+    strncpy(lastHang.data.task, task, sizeof(lastHang.data.task) - 1);
+    lastHang.data.task[sizeof(lastHang.data.task) - 1] = 0;
+    lastHang.data.lateMs = lateMs;
+    lastHang.data.time = Time.now();
+    lastHang.seal();
+}
+
+//Pick the session back up after a reset, or start fresh
+//  The trip in progress is timed from when the vacuum left by the wall clock, so the
+//  reboot itself counts as vacuuming. Stopped early is only a 2 s picture, go back to dirty.
+void resumeSession(){
+    uint64_t nowMs = epochMillis();
+
+    if(vacuumState < CHARGING_NOT_DIRTY || vacuumState > FINISHED_TAKE_REWARD){
+        vacuumState = CHARGING_NOT_DIRTY;
+    }
+    if(vacuumState == STOPPED_EARLY){
+        vacuumState = CHARGING_YES_DIRTY;
+    }
+    vacStartTime = millis();
+    if(!isVacCharging && vacRemovedTimeMs != 0 && nowMs > vacRemovedTimeMs){
+        vacStartTime = millis() - min(nowMs - vacRemovedTimeMs, (uint64_t)MAX_EVENT_AGE);
+    }
+    if(vacuumState != CHARGING_NOT_DIRTY){
+        trace.printf("Resuming \"%s\", %ims done\n\n", VAC_STATE_STRING[vacuumState], prevVacTime + (int)(millis() - vacStartTime));
+    }
+    lastVacuumState = vacuumState;
+    vacMachine.start(vacuumState);
+}
+
+//Write the counters to the store - on a schedule, after a big change in dust, and on a reward
+//  Only values that changed since the last checkpoint get a record.
+void checkpointCounters(){
+    store.set(STORE_TOTAL_DUST, totalDust);
+    store.set(STORE_LAST_VAC_UNIX, previousUnixTime);
+    store.set(STORE_PREV_VAC_TIME, prevVacTime);
+    store.flush();
+    dustSeries.sync();
+    checkpointDust = totalDust;
+}
+
+//Read the counters from the store
+//  Older firmware kept them at fixed addresses, move them into the store the first time.
+void loadStore(){
+    if(!store.has(STORE_TOTAL_DUST)){
+        EEPROM.get(totalDustAddress, totalDust);
+        store.set(STORE_TOTAL_DUST, totalDust == 0xFFFFFFFF ? 0 : totalDust);   //blank EEPROM
+    }
+    if(!store.has(STORE_LAST_VAC_UNIX)){
+        EEPROM.get(timeAddress, previousUnixTime);
+        store.set(STORE_LAST_VAC_UNIX, previousUnixTime == 0xFFFFFFFF ? 0 : previousUnixTime);
+    }
+    store.flush();
+
+    totalDust = store.get(STORE_TOTAL_DUST);
+    previousUnixTime = store.get(STORE_LAST_VAC_UNIX);
+    prevVacTime = store.get(STORE_PREV_VAC_TIME);
+    trace.printf("Store: %lu bad records\n", store.badRecords());
+}
+
 // Function to connect and reconnect as necessary to the MQTT server.
 // Should be called in the loop function and it will take care of connecting.
 void MQTT_connect(){
@@ -369,30 +777,86 @@ void MQTT_connect(){
         return;
     }
 
-    Serial.print("Connecting to MQTT... ");
+    trace.printf("Connecting to MQTT... ");
 
     while((ret = mqtt.connect()) != 0){
-        Serial.printf("Error Code %s\n", mqtt.connectErrorString(ret));
-        Serial.printf("Retrying MQTT connection in 5 seconds...\n");
+        trace.printf("Error Code %s\n", mqtt.connectErrorString(ret));
+        trace.printf("Retrying MQTT connection in 5 seconds...\n");
         mqtt.disconnect();
         delay(5000);
     }
-    Serial.printf("MQTT Connected!\n");
+    trace.printf("MQTT Connected to %s! DNS: %lums, TCP: %lums, CONNACK: %lums\n", mqtt.brokerName(),
+        mqtt.connectTiming().dns_ms, mqtt.connectTiming().tcp_ms, mqtt.connectTiming().connack_ms);
 }
 
 //Keeps the connection open to Adafruit
+//  The library only pings once the link has been quiet for most of the keepalive,
+//  and doesn't wait for the reply. A ping that never gets answered drops the connection.
 bool MQTT_ping() {
-    static unsigned int last;
-    bool pingStatus;
-
-    if ((millis()-last)>120000) {
-        Serial.printf("Pinging MQTT \n");
-        pingStatus = mqtt.ping();
-        if(!pingStatus) {
-        Serial.printf("Disconnecting \n");
-        mqtt.disconnect();
+    if(!mqtt.keepalive()){
+        trace.printf("MQTT keepalive failed, reconnecting\n");
+        return false;
+    }
+    return true;
+}
+
+//Work out when it will be time to vacuum, from the dust rate or the days since vacuuming
+//  Runs as each sample arrives, so answering "when?" later is just reading a variable.
+void updateForecast(){
+    if(!Time.isValid()){
+        return;
+    }
+    uint32_t now = Time.now();
+    int dustSeconds = totalDust >= (unsigned int)MAX_DUST ? 0 : dustForecast.secondsUntil(now, MAX_DUST - totalDust);
+    int daysSeconds = max((int)(MAX_TIME_SINCE_VAC - (now - previousUnixTime)), 0);
+    int dirtySeconds = (dustSeconds < 0) ? daysSeconds : min(dustSeconds, daysSeconds);
+
+    snprintf(dirtyForecast, sizeof(dirtyForecast), "dirty in %.1fh (dust %.1fh, days %.1fh) %.0f/h",
+        dirtySeconds / 3600.0, dustSeconds < 0 ? INFINITY : dustSeconds / 3600.0, daysSeconds / 3600.0,
+        dustForecast.ratePerHour());
+    trace.printf("Forecast: %s\n\n", dirtyForecast);
+    forecastPub.publish(dirtySeconds / 3600.0);
+}
+
+//Dust history from the samples kept on the ATM, for the dustHistory cloud function
+//  command is "bucket minutes,hours back", default "60,24". The answer goes in the
+//  dustHistory variable as the first bucket's start time and length, then min/max/avg
+//  for each bucket, or - when it has no samples. Returns buckets with samples, -1 if bad.
+int queryDustHistory(String command){
+    DustBucket buckets[DUST_HISTORY_BUCKETS];
+    int bucketMinutes = 60;
+    int hours = 24;
+    int len;
+
+    if(command.length() > 0){
+        if(sscanf(command.c_str(), "%i,%i", &bucketMinutes, &hours) < 1){
+            return -1;
+        }
+    }
+    if(bucketMinutes <= 0 || hours <= 0 || !Time.isValid()){
+        return -1;
+    }
+    //no further back than the oldest sample held, which also keeps the sums below in range
+    uint32_t now = Time.now();
+    uint32_t heldHours = 1;
+    if(dustSeries.samples() > 0 && now > dustSeries.oldestTime()){
+        heldHours = (now - dustSeries.oldestTime()) / 3600 + 1;
+    }
+    hours = min((uint32_t)hours, heldHours);
+    bucketMinutes = min(bucketMinutes, hours * 60);
+    int count = min(hours * 60 / bucketMinutes, DUST_HISTORY_BUCKETS);
+    uint32_t bucketSeconds = bucketMinutes * 60;
+    uint32_t since = now - count * bucketSeconds;
+    int filled = dustSeries.query(since, bucketSeconds, buckets, count);
+
+    len = snprintf(dustHistory, sizeof(dustHistory), "%lu+%lu", (unsigned long)since, (unsigned long)bucketSeconds);
+    for(int i=0; i<count && len < (int)sizeof(dustHistory); i++){
+        if(buckets[i].count == 0){
+            len = len + snprintf(dustHistory + len, sizeof(dustHistory) - len, " -");
+        } else{
+            len = len + snprintf(dustHistory + len, sizeof(dustHistory) - len, " %li/%li/%li", (long)buckets[i].min,
+                (long)buckets[i].max, (long)(buckets[i].sum / buckets[i].count));
         }
-        last = millis();
     }
-    return pingStatus;
-}
\ No newline at end of file
+    return filled;
+}
@@ -112,6 +112,26 @@ Adafruit_MQTT::Adafruit_MQTT(const char *server,
     subscriptions[i] = 0;
   }
 
+  // reset publish topics, rate limits and the outbox
+  for (uint8_t i=0; i<MAXPUBLISHERS; i++) {
+    publish_topics[i] = 0;
+    publish_latest[i] = false;
+    memset(&publish_rate[i], 0, sizeof(publish_rate[i]));
+  }
+  memset(&rate_limit, 0, sizeof(rate_limit));
+  rate_scale = 100;
+  rate_paused_until = 0;
+  rate_last_backoff = 0;
+  throttle_sub = 0;
+  errors_sub = 0;
+  outbox_head = 0;
+  outbox_count = 0;
+  outbox_drops = 0;
+  outbox_restored = false;
+  outbox_dirty = false;
+  outbox_stored = 0;
+  outbox_saved_at = 0;
+
   will_topic = 0;
   will_payload = 0;
   will_qos = 0;
@@ -119,6 +139,17 @@ Adafruit_MQTT::Adafruit_MQTT(const char *server,
 
   packet_id_counter = 0;
 
+  memset(&connect_timing, 0, sizeof(connect_timing));
+  last_send_ms = 0;
+  last_recv_ms = 0;
+  ping_outstanding = false;
+  ping_sent_ms = 0;
+  ping_rtt_ms = 0;
+
+  memset(&stats, 0, sizeof(stats));
+  session_up = false;
+  session_seen = false;
+  disconnect_cause = MQTT_CAUSE_PEER;
 }
 
 
@@ -137,6 +168,26 @@ Adafruit_MQTT::Adafruit_MQTT(const char *server,
     subscriptions[i] = 0;
   }
 
+  // reset publish topics, rate limits and the outbox
+  for (uint8_t i=0; i<MAXPUBLISHERS; i++) {
+    publish_topics[i] = 0;
+    publish_latest[i] = false;
+    memset(&publish_rate[i], 0, sizeof(publish_rate[i]));
+  }
+  memset(&rate_limit, 0, sizeof(rate_limit));
+  rate_scale = 100;
+  rate_paused_until = 0;
+  rate_last_backoff = 0;
+  throttle_sub = 0;
+  errors_sub = 0;
+  outbox_head = 0;
+  outbox_count = 0;
+  outbox_drops = 0;
+  outbox_restored = false;
+  outbox_dirty = false;
+  outbox_stored = 0;
+  outbox_saved_at = 0;
+
   will_topic = 0;
   will_payload = 0;
   will_qos = 0;
@@ -144,20 +195,50 @@ Adafruit_MQTT::Adafruit_MQTT(const char *server,
 
   packet_id_counter = 0;
 
+  memset(&connect_timing, 0, sizeof(connect_timing));
+  last_send_ms = 0;
+  last_recv_ms = 0;
+  ping_outstanding = false;
+  ping_sent_ms = 0;
+  ping_rtt_ms = 0;
+
+  memset(&stats, 0, sizeof(stats));
+  session_up = false;
+  session_seen = false;
+  disconnect_cause = MQTT_CAUSE_PEER;
+}
+
+static void histogramAdd(Adafruit_MQTT_Histogram *h, uint32_t ms) {
+  uint8_t bin = 0;
+  while (bin < MQTT_HISTOGRAM_BINS-1 && (ms >> (bin+1)))
+    bin++;
+  h->bins[bin]++;
+  h->count++;
+  if (ms > h->max)
+    h->max = ms;
 }
 
 int8_t Adafruit_MQTT::connect() {
+  uint32_t connectstart = millis();
+  connect_timing.connack_ms = 0;
+
+  // Calling connect() on a live session means the socket dropped on its own.
+  connectionLost(MQTT_CAUSE_PEER);
+
   // Connect to the server.
   if (!connectServer())
     return -1;
 
   // Construct and send connect packet.
+  uint32_t connackstart = millis();
+  ping_outstanding = false;
   uint8_t len = connectPacket(buffer);
-  if (!sendPacket(buffer, len))
+  if (!writePacket(buffer, len))
     return -1;
 
   // Read connect response packet and verify it
   len = readFullPacket(buffer, MAXBUFFERSIZE, CONNECT_TIMEOUT_MS);
+  connect_timing.connack_ms = millis() - connackstart;
   if (len != 4)
     return -1;
   if ((buffer[0] != (MQTT_CTRL_CONNECTACK << 4)) || (buffer[1] != 2))
@@ -174,7 +255,7 @@ int8_t Adafruit_MQTT::connect() {
     for (uint8_t retry=0; (retry<3) && !success; retry++) { // retry until we get a suback    
       // Construct and send subscription packet.
       uint8_t len = subscribePacket(buffer, subscriptions[i]->topic, subscriptions[i]->qos);
-      if (!sendPacket(buffer, len))
+      if (!writePacket(buffer, len))
 	return -1;
 
       if(MQTT_PROTOCOL_LEVEL < 3) // older versions didn't suback
@@ -194,9 +275,43 @@ int8_t Adafruit_MQTT::connect() {
     if (! success) return -2; // failed to sub for some reason
   }
 
+  // Ask for current values only once every SUBACK is in, replies that came
+  // in while we waited for a SUBACK would have been dropped.
+  for (uint8_t i=0; i<MAXSUBSCRIPTIONS; i++) {
+    if (subscriptions[i] == 0 || !subscriptions[i]->fetch_last) continue;
+
+    char gettopic[MQTT_GET_TOPICLEN];
+    if (strlen(subscriptions[i]->topic) + 5 > sizeof(gettopic)) {
+      ERROR_PRINTLN(F("Topic too long to fetch"));
+      continue;
+    }
+    strcpy(gettopic, subscriptions[i]->topic);
+    strcat(gettopic, "/get");
+    subscriptions[i]->fetch_pending = sendPublish(gettopic, (uint8_t *)"", 0, 0);
+  }
+
+  histogramAdd(&stats.connect_ms, millis() - connectstart);
+  if (session_seen) {
+    stats.reconnects++;
+    stats.reconnect_causes[disconnect_cause]++;
+  }
+  session_up = true;
+  session_seen = true;
+
+  // Replay anything published while we were offline.
+  flushOutbox();
+
   return 0;
 }
 
+void Adafruit_MQTT::connectionLost(uint8_t cause) {
+  saveOutbox();  // what's queued now has to wait for a reconnect
+  if (!session_up)
+    return;
+  session_up = false;
+  disconnect_cause = cause;
+}
+
 int8_t Adafruit_MQTT::connect(const char *user, const char *pass)
 {
   username = user;
@@ -216,6 +331,7 @@ uint16_t Adafruit_MQTT::processPacketsUntil(uint8_t *buffer, uint8_t waitforpack
       return len;
     } else {
       ERROR_PRINTLN(F("Dropped a packet"));
+      stats.dropped++;
     }
   }
   return 0;
@@ -257,12 +373,24 @@ uint16_t Adafruit_MQTT::readFullPacket(uint8_t *buffer, uint16_t maxsize, uint16
   
   if (value > (unsigned)(maxsize - (pbuff-buffer) - 1)) {
       DEBUG_PRINTLN(F("Packet too big for buffer"));
+      stats.truncated++;
       rlen = readPacket(pbuff, (maxsize - (pbuff-buffer) - 1), timeout);
   } else {
     rlen = readPacket(pbuff, value, timeout);
   }
   //DEBUG_PRINT(F("Remaining packet:\t")); DEBUG_PRINTBUFFER(pbuff, rlen);
 
+  // Any packet shows the link is alive, a PINGRESP also answers keepalive().
+  last_recv_ms = millis();
+  stats.bytes_in += (pbuff - buffer) + rlen;
+  stats.packets_in[buffer[0] >> 4]++;
+  if ((buffer[0] >> 4) == MQTT_CTRL_PINGRESP && ping_outstanding) {
+    ping_outstanding = false;
+    ping_rtt_ms = last_recv_ms - ping_sent_ms;
+    histogramAdd(&stats.ping_rtt_ms, ping_rtt_ms);
+    DEBUG_PRINT(F("Ping RTT: ")); DEBUG_PRINTLN(ping_rtt_ms);
+  }
+
   return ((pbuff - buffer)+rlen);
 }
 
@@ -283,10 +411,11 @@ const FLASH_STRING* Adafruit_MQTT::connectErrorString(int8_t code)
 }
 
 bool Adafruit_MQTT::disconnect() {
+  connectionLost(MQTT_CAUSE_LOCAL);
 
   // Construct and send disconnect packet.
   uint8_t len = disconnectPacket(buffer);
-  if (! sendPacket(buffer, len))
+  if (! writePacket(buffer, len))
     DEBUG_PRINTLN(F("Unable to send disconnect packet"));
 
   return disconnectServer();
@@ -299,13 +428,43 @@ bool Adafruit_MQTT::publish(const char *topic, const char *data, uint8_t qos) {
 }
 
 bool Adafruit_MQTT::publish(const char *topic, uint8_t *data, uint16_t bLen, uint8_t qos) {
+  // It has to fit the packet buffer whichever way it goes out.
+  if (publishPacketLen(topic, bLen, qos) > MAXBUFFERSIZE) {
+    ERROR_PRINTLN(F("Publish too big for the packet buffer"));
+    return false;
+  }
+
+  // Too big for an outbox slot, like a diagnostics line.  It goes out now or
+  // not at all, so it isn't counted as a lost queued message.
+  if (bLen > MQTT_OUTBOX_PAYLOADLEN)
+    return connected() && takeRateToken(topic) && sendPublish(topic, data, bLen, qos);
+
+  // Anything already waiting has to go out first to keep the order, so new
+  // messages queue behind it.  So do messages over the rate limit.
+  if (!connected() || outbox_count > 0 || !takeRateToken(topic)) {
+    if (!queuePublish(topic, data, bLen, qos))
+      return false;
+    return connected() && flushOutbox();
+  }
+
+  if (sendPublish(topic, data, bLen, qos))
+    return true;
+
+  // The connection dropped under us, hold on to the message for the reconnect.
+  if (!connected())
+    queuePublish(topic, data, bLen, qos);
+  return false;
+}
+
+bool Adafruit_MQTT::sendPublish(const char *topic, uint8_t *data, uint16_t bLen, uint8_t qos) {
   // Construct and send publish packet.
   uint16_t len = publishPacket(buffer, topic, data, bLen, qos);
-  if (!sendPacket(buffer, len))
+  if (len == 0 || !writePacket(buffer, len))
     return false;
 
   // If QOS level is high enough verify the response packet.
   if (qos > 0) {
+    uint32_t sent = millis();
     len = readFullPacket(buffer, MAXBUFFERSIZE, PUBLISH_TIMEOUT_MS);
     DEBUG_PRINT(F("Publish QOS1+ reply:\t"));
     DEBUG_PRINTBUFFER(buffer, len);
@@ -321,6 +480,7 @@ bool Adafruit_MQTT::publish(const char *topic, uint8_t *data, uint16_t bLen, uin
     packnum++;
     if (packnum != packet_id_counter)
       return false;
+    histogramAdd(&stats.puback_ms, millis() - sent);
   }
 
   return true;
@@ -342,6 +502,309 @@ bool Adafruit_MQTT::will(const char *topic, const char *payload, uint8_t qos, ui
 
 }
 
+bool Adafruit_MQTT::addPublishTopic(const char *topic, bool latest) {
+  uint8_t i;
+  // update the flag if we already know this topic
+  for (i=0; i<MAXPUBLISHERS; i++) {
+    if (publish_topics[i] && strcmp(publish_topics[i], topic) == 0) {
+      publish_latest[i] = latest;
+      return true;
+    }
+  }
+  for (i=0; i<MAXPUBLISHERS; i++) {
+    if (publish_topics[i] == 0) {
+      publish_topics[i] = topic;
+      publish_latest[i] = latest;
+      return true;
+    }
+  }
+
+  DEBUG_PRINTLN(F("no more publish topic space :("));
+  return false;
+}
+
+int8_t Adafruit_MQTT::findPublishTopic(const char *topic) {
+  for (uint8_t i=0; i<MAXPUBLISHERS; i++) {
+    if (publish_topics[i] && strcmp(publish_topics[i], topic) == 0)
+      return i;
+  }
+  return -1;
+}
+
+bool Adafruit_MQTT::queuePublish(const char *topic, uint8_t *data, uint16_t bLen, uint8_t qos) {
+  Adafruit_MQTT_OutboxEntry *entry;
+
+  if (bLen > MQTT_OUTBOX_PAYLOADLEN) {
+    DEBUG_PRINTLN(F("Publish too big for the outbox"));
+    return false;
+  }
+  restoreOutbox();
+
+  // A latest-value feed only needs its newest value, overwrite the queued one.
+  int8_t t = findPublishTopic(topic);
+  if (t >= 0 && publish_latest[t]) {
+    for (uint8_t i=0; i<outbox_count; i++) {
+      entry = &outbox[(outbox_head + i) % MQTT_OUTBOX_DEPTH];
+      if (strcmp(entry->topic, topic) == 0) {
+        DEBUG_PRINTLN(F("Coalesced queued publish"));
+        memmove(entry->payload, data, bLen);
+        entry->len = bLen;
+        entry->qos = qos;
+        outbox_dirty = true;
+        return true;
+      }
+    }
+  }
+
+  // Full, drop the oldest message to make room.
+  if (outbox_count == MQTT_OUTBOX_DEPTH) {
+    ERROR_PRINTLN(F("Outbox full, dropped a publish"));
+    outbox_head = (outbox_head + 1) % MQTT_OUTBOX_DEPTH;
+    outbox_count--;
+    outbox_drops++;
+  }
+
+  entry = &outbox[(outbox_head + outbox_count) % MQTT_OUTBOX_DEPTH];
+  entry->topic = topic;
+  entry->qos = qos;
+  entry->len = bLen;
+  memmove(entry->payload, data, bLen);
+  outbox_count++;
+  DEBUG_PRINT(F("Queued publish, outbox depth ")); DEBUG_PRINTLN(outbox_count);
+
+  outbox_dirty = true;
+  return true;
+}
+
+bool Adafruit_MQTT::flushOutbox() {
+  uint8_t sent = 0;
+
+  restoreOutbox();
+  while (outbox_count > 0 && connected()) {
+    Adafruit_MQTT_OutboxEntry *entry = &outbox[outbox_head];
+    if (!takeRateToken(entry->topic))
+      break;  // over budget, wait for it to refill
+    if (!sendPublish(entry->topic, entry->payload, entry->len, entry->qos))
+      break;  // try again on the next flush
+    outbox_head = (outbox_head + 1) % MQTT_OUTBOX_DEPTH;
+    outbox_count--;
+    sent++;
+  }
+  if (sent) {
+    DEBUG_PRINT(F("Replayed from outbox: ")); DEBUG_PRINTLN(sent);
+    outbox_dirty = true;
+  }
+
+  // Connected, the queue only holds what the rate limit deferred and it goes
+  // out soon.  Just forget the stored copy once it's all sent, so a reset
+  // doesn't send it again.  Offline, keep what piles up but not every change.
+  if (connected()) {
+    if (outbox_count == 0 && outbox_stored > 0)
+      saveOutbox();
+  } else if (millis() - outbox_saved_at >= MQTT_OUTBOX_SAVE_MS) {
+    saveOutbox();
+  }
+  return outbox_count == 0;
+}
+
+// Stored outbox layout: magic, count, then each message oldest first as
+// topic hash (2), qos (1), length (1) and a fixed size payload.  Topics are
+// matched back to the registered publish topics by hash when restoring.
+#define MQTT_OUTBOX_MAGIC      0xB1  // changes with the layout
+#define MQTT_OUTBOX_HEADERLEN  2
+#define MQTT_OUTBOX_RECORDLEN  (4 + MQTT_OUTBOX_PAYLOADLEN)
+
+static uint16_t topicHash(const char *topic) {
+  // FNV-1a, folded to 16 bits
+  uint32_t h = 2166136261UL;
+  while (*topic) {
+    h ^= (uint8_t)*topic++;
+    h *= 16777619UL;
+  }
+  return (h >> 16) ^ (h & 0xFFFF);
+}
+
+void Adafruit_MQTT::saveOutbox() {
+  uint8_t record[MQTT_OUTBOX_RECORDLEN];
+
+  if (!outbox_dirty)
+    return;
+  outbox_dirty = false;
+  outbox_saved_at = millis();
+  record[0] = MQTT_OUTBOX_MAGIC;
+  record[1] = outbox_count;
+  if (!storeOutbox(0, record, MQTT_OUTBOX_HEADERLEN))
+    return;  // no persistent storage
+
+  outbox_stored = outbox_count;
+  for (uint8_t i=0; i<outbox_count; i++) {
+    Adafruit_MQTT_OutboxEntry *entry = &outbox[(outbox_head + i) % MQTT_OUTBOX_DEPTH];
+    uint16_t hash = topicHash(entry->topic);
+    memset(record, 0, sizeof(record));
+    record[0] = hash >> 8;
+    record[1] = hash & 0xFF;
+    record[2] = entry->qos;
+    record[3] = entry->len;
+    memmove(record+4, entry->payload, entry->len);
+    storeOutbox(MQTT_OUTBOX_HEADERLEN + i*MQTT_OUTBOX_RECORDLEN, record, MQTT_OUTBOX_RECORDLEN);
+  }
+}
+
+void Adafruit_MQTT::restoreOutbox() {
+  uint8_t record[MQTT_OUTBOX_RECORDLEN];
+
+  // Only once per boot, and only after the publish topics are registered.
+  if (outbox_restored)
+    return;
+  outbox_restored = true;
+
+  if (!loadOutbox(0, record, MQTT_OUTBOX_HEADERLEN))
+    return;
+  if (record[0] != MQTT_OUTBOX_MAGIC || record[1] > MQTT_OUTBOX_DEPTH)
+    return;  // never written, or from another layout
+
+  uint8_t stored = record[1];
+  outbox_stored = stored;
+  for (uint8_t i=0; i<stored; i++) {
+    if (!loadOutbox(MQTT_OUTBOX_HEADERLEN + i*MQTT_OUTBOX_RECORDLEN, record, MQTT_OUTBOX_RECORDLEN))
+      break;
+    uint16_t hash = (record[0] << 8) | record[1];
+    const char *topic = 0;
+    for (uint8_t t=0; t<MAXPUBLISHERS; t++) {
+      if (publish_topics[t] && topicHash(publish_topics[t]) == hash) {
+        topic = publish_topics[t];
+        break;
+      }
+    }
+    if (topic == 0 || record[3] > MQTT_OUTBOX_PAYLOADLEN || outbox_count == MQTT_OUTBOX_DEPTH) {
+      outbox_drops++;  // feed no longer registered
+      continue;
+    }
+    Adafruit_MQTT_OutboxEntry *entry = &outbox[(outbox_head + outbox_count) % MQTT_OUTBOX_DEPTH];
+    entry->topic = topic;
+    entry->qos = record[2];
+    entry->len = record[3];
+    memmove(entry->payload, record+4, entry->len);
+    outbox_count++;
+  }
+  DEBUG_PRINT(F("Restored from outbox: ")); DEBUG_PRINTLN(outbox_count);
+}
+
+void Adafruit_MQTT::setRateLimit(uint16_t per_minute, uint8_t burst) {
+  rate_limit.per_minute = per_minute;
+  rate_limit.burst = burst ? burst : 1;
+  rate_limit.micro_tokens = rate_limit.burst * 1000000UL;
+  rate_limit.last_refill = millis();
+}
+
+bool Adafruit_MQTT::setPublishRateLimit(const char *topic, uint16_t per_minute, uint8_t burst) {
+  int8_t t = findPublishTopic(topic);
+  if (t < 0)
+    return false;
+  publish_rate[t].per_minute = per_minute;
+  publish_rate[t].burst = burst ? burst : 1;
+  publish_rate[t].micro_tokens = publish_rate[t].burst * 1000000UL;
+  publish_rate[t].last_refill = millis();
+  return true;
+}
+
+bool Adafruit_MQTT::watchThrottle(Adafruit_MQTT_Subscribe *throttle, Adafruit_MQTT_Subscribe *errors) {
+  throttle_sub = throttle;
+  errors_sub = errors;
+  if (throttle && !subscribe(throttle))
+    return false;
+  if (errors && !subscribe(errors))
+    return false;
+  return true;
+}
+
+uint8_t Adafruit_MQTT::rateLimitUsage() {
+  if (throttled())
+    return 100;
+  if (rate_limit.per_minute == 0)
+    return 0;
+  refillRate(&rate_limit);
+  return 100 - rate_limit.micro_tokens / (10000UL * rate_limit.burst);
+}
+
+void Adafruit_MQTT::refillRate(Adafruit_MQTT_RateLimit *bucket) {
+  uint32_t now = millis();
+  uint32_t elapsed = now - bucket->last_refill;
+  uint32_t full = bucket->burst * 1000000UL;
+
+  bucket->last_refill = now;
+  if (elapsed > 600000UL)
+    elapsed = 600000UL;  // long idle, the bucket is full anyway
+
+  // per_minute publishes a minute, scaled down while we are backing off.
+  uint64_t gained = (uint64_t)elapsed * bucket->per_minute * rate_scale * 1000000ULL / (60000ULL * 100);
+  if (bucket->micro_tokens + gained > full)
+    bucket->micro_tokens = full;
+  else
+    bucket->micro_tokens += gained;
+}
+
+bool Adafruit_MQTT::takeRateToken(const char *topic) {
+  Adafruit_MQTT_RateLimit *feed = 0;
+  int8_t t;
+
+  if (throttled())
+    return false;
+
+  // Creep back towards the configured rate after a quiet minute.
+  if (rate_scale < 100 && (millis() - rate_last_backoff) > 60000UL) {
+    rate_scale = min(100, rate_scale + 10);
+    rate_last_backoff = millis();
+  }
+
+  if (rate_limit.per_minute) {
+    refillRate(&rate_limit);
+    if (rate_limit.micro_tokens < 1000000UL)
+      return false;
+  }
+  t = findPublishTopic(topic);
+  if (t >= 0 && publish_rate[t].per_minute) {
+    feed = &publish_rate[t];
+    refillRate(feed);
+    if (feed->micro_tokens < 1000000UL)
+      return false;
+  }
+
+  // Both buckets have room, spend from each.
+  if (rate_limit.per_minute)
+    rate_limit.micro_tokens -= 1000000UL;
+  if (feed)
+    feed->micro_tokens -= 1000000UL;
+  return true;
+}
+
+void Adafruit_MQTT::backOff(const char *msg, uint16_t len, uint16_t pause) {
+  uint32_t seconds = 0;
+
+  // Adafruit IO says "... N seconds until throttle released", pick out the
+  // number in front of "second".
+  for (uint16_t i=0; i<len; i++) {
+    if (isdigit(msg[i])) {
+      uint32_t n = 0;
+      while (i < len && isdigit(msg[i]))
+        n = n*10 + (msg[i++] - '0');
+      while (i < len && msg[i] == ' ')
+        i++;
+      if (len - i >= 6 && strncasecmp(msg+i, "second", 6) == 0)
+        seconds = n;
+    }
+  }
+  if (seconds == 0)
+    seconds = pause;  // no hint given
+
+  if (seconds) {
+    ERROR_PRINT(F("Throttled for ")); ERROR_PRINTLN(seconds);
+    rate_paused_until = millis() + seconds*1000UL;
+  }
+  rate_last_backoff = millis();
+  rate_scale = max(12, rate_scale / 2);
+}
+
 bool Adafruit_MQTT::subscribe(Adafruit_MQTT_Subscribe *sub) {
   uint8_t i;
   // see if we are already subscribed
@@ -379,7 +842,7 @@ bool Adafruit_MQTT::unsubscribe(Adafruit_MQTT_Subscribe *sub) {
       uint8_t len = unsubscribePacket(buffer, subscriptions[i]->topic);
 
       // sending unsubscribe failed
-      if (! sendPacket(buffer, len))
+      if (! writePacket(buffer, len))
         return false;
 
       // if QoS for this subscription is 1 or 2, we need
@@ -439,6 +902,15 @@ void Adafruit_MQTT::processPackets(int16_t timeout) {
         //Serial.print("*** calling io instance callback with : "); Serial.println((char *)sub->lastread);
         ((sub->io_feed)->*(sub->callback_io))((char *)sub->lastread, sub->datalen);
       }
+      else if (sub->callback_view != NULL) {
+        // view mode, hand over the payload where it sits in the buffer
+        sub->callback_view(sub->payload_view);
+      }
+      else if (sub->binary_decoder != NULL) {
+        // binary mode, the decoder knows the type the callback wants
+        if (!sub->binary_decoder(sub->callback_binary, sub->payload_view.data, sub->payload_view.len))
+          ERROR_PRINTLN(F("Binary payload size mismatch"));
+      }
     }
 
     // keep track over elapsed time
@@ -460,6 +932,11 @@ Adafruit_MQTT_Subscribe *Adafruit_MQTT::readSubscription(int16_t timeout) {
   DEBUG_PRINT("Packet len: "); DEBUG_PRINTLN(len); 
   DEBUG_PRINTBUFFER(buffer, len);
 
+  // Only PUBLISH packets carry subscription data (PINGRESP was already
+  // handled when it was read).
+  if ((buffer[0] >> 4) != MQTT_CTRL_PUBLISH)
+    return NULL;
+
   // Parse out length of packet.
   topiclen = buffer[3];
   DEBUG_PRINT(F("Looking for subscription len ")); DEBUG_PRINTLN(topiclen);
@@ -491,25 +968,42 @@ Adafruit_MQTT_Subscribe *Adafruit_MQTT::readSubscription(int16_t timeout) {
     packetid |= buffer[topiclen+5];
   }
 
-  // zero out the old data
-  memset(subscriptions[i]->lastread, 0, SUBSCRIPTIONDATALEN);
-
   datalen = len - topiclen - packet_id_len - 4;
-  if (datalen > SUBSCRIPTIONDATALEN) {
-    datalen = SUBSCRIPTIONDATALEN-1; // cut it off
+  subscriptions[i]->is_retained = (buffer[0] & 0x1) || subscriptions[i]->fetch_pending;
+  subscriptions[i]->fetch_pending = false;
+  subscriptions[i]->payload_view.data = buffer+4+topiclen+packet_id_len;
+  subscriptions[i]->payload_view.len = datalen;
+
+  // Throttle notices are longer than lastread holds, read them in place.
+  // A throttle notice without a time still means stop for a while, an
+  // error only slows us down.
+  if (subscriptions[i] == throttle_sub)
+    backOff((char *)buffer+4+topiclen+packet_id_len, datalen, 60);
+  else if (subscriptions[i] == errors_sub)
+    backOff((char *)buffer+4+topiclen+packet_id_len, datalen, 0);
+
+  // Handlers that parse in place read the view, skip the copy.
+  if (subscriptions[i]->callback_view == NULL && subscriptions[i]->binary_decoder == NULL) {
+    // zero out the old data
+    memset(subscriptions[i]->lastread, 0, SUBSCRIPTIONDATALEN);
+
+    if (datalen > SUBSCRIPTIONDATALEN) {
+      datalen = SUBSCRIPTIONDATALEN-1; // cut it off
+      stats.truncated++;
+    }
+    // extract out just the data, into the subscription object itself
+    memmove(subscriptions[i]->lastread, buffer+4+topiclen+packet_id_len, datalen);
+    subscriptions[i]->datalen = datalen;
+    DEBUG_PRINT(F("Data len: ")); DEBUG_PRINTLN(datalen);
+    DEBUG_PRINT(F("Data: ")); DEBUG_PRINTLN((char *)subscriptions[i]->lastread);
   }
-  // extract out just the data, into the subscription object itself
-  memmove(subscriptions[i]->lastread, buffer+4+topiclen+packet_id_len, datalen);
-  subscriptions[i]->datalen = datalen;
-  DEBUG_PRINT(F("Data len: ")); DEBUG_PRINTLN(datalen);
-  DEBUG_PRINT(F("Data: ")); DEBUG_PRINTLN((char *)subscriptions[i]->lastread);
 
   if ((MQTT_PROTOCOL_LEVEL > 3) &&(buffer[0] & 0x6) == 0x2) {
     uint8_t ackpacket[4];
     
     // Construct and send puback packet.
     uint8_t len = pubackPacket(ackpacket, packetid);
-    if (!sendPacket(ackpacket, len))
+    if (!writePacket(ackpacket, len))
       DEBUG_PRINT(F("Failed"));
   }
 
@@ -529,8 +1023,10 @@ bool Adafruit_MQTT::ping(uint8_t num) {
   while (num--) {
     // Construct and send ping packet.
     uint8_t len = pingPacket(buffer);
-    if (!sendPacket(buffer, len))
+    if (!writePacket(buffer, len))
       continue;
+    ping_outstanding = true;  // lets readFullPacket() time the reply
+    ping_sent_ms = millis();
 
     // Process ping reply.
     len = processPacketsUntil(buffer, MQTT_CTRL_PINGRESP, PING_TIMEOUT_MS);
@@ -541,6 +1037,62 @@ bool Adafruit_MQTT::ping(uint8_t num) {
   return false;
 }
 
+bool Adafruit_MQTT::keepalive() {
+  uint32_t now = millis();
+  uint32_t idle = MQTT_CONN_KEEPALIVE * 1000UL * MQTT_PING_IDLE_PCT / 100;
+
+  if (!connected())
+    return false;
+
+  maintainServer();
+  if (!connected())
+    return false;
+
+  if (ping_outstanding) {
+    // With no subscriptions nobody else reads the socket, pick up the reply
+    // here.
+    bool reader = false;
+    for (uint8_t i=0; i<MAXSUBSCRIPTIONS; i++) {
+      if (subscriptions[i]) reader = true;
+    }
+    if (!reader)
+      readFullPacket(buffer, MAXBUFFERSIZE, 0);
+
+    if (ping_outstanding && (now - ping_sent_ms) > MQTT_PINGRESP_TIMEOUT_MS) {
+      // The broker has gone quiet on us, the connection is half-open.
+      ERROR_PRINTLN(F("Ping unanswered, dropping connection"));
+      ping_outstanding = false;
+      connectionLost(MQTT_CAUSE_PING);
+      disconnectServer();
+      return false;
+    }
+    return true;
+  }
+
+  // Nothing to do while traffic keeps the link alive.  Idle receive counts
+  // too, so a dead link is found even when we're publishing.
+  if ((now - last_send_ms) < idle && (now - last_recv_ms) < idle)
+    return true;
+
+  uint8_t len = pingPacket(buffer);
+  if (!writePacket(buffer, len))
+    return false;
+  ping_outstanding = true;
+  ping_sent_ms = now;
+  return true;
+}
+
+bool Adafruit_MQTT::writePacket(uint8_t *buffer, uint16_t len) {
+  if (!sendPacket(buffer, len)) {
+    connectionLost(MQTT_CAUSE_SEND);
+    return false;
+  }
+  last_send_ms = millis();
+  stats.bytes_out += len;
+  stats.packets_out[buffer[0] >> 4]++;
+  return true;
+}
+
 // Packet Generation Functions /////////////////////////////////////////////////
 
 // The current MQTT spec is 3.1.1 and available here:
@@ -632,12 +1184,29 @@ uint8_t Adafruit_MQTT::connectPacket(uint8_t *packet) {
 }
 
 
+// Whole size of a publish packet, fixed header included.
+uint32_t Adafruit_MQTT::publishPacketLen(const char *topic, uint16_t bLen, uint8_t qos) {
+  uint32_t len = 2 + strlen(topic) + bLen;
+  if (qos > 0)
+    len += 2;
+  uint32_t header = 2;  // control byte and one byte of remaining length
+  for (uint32_t left = len / 128; left > 0; left /= 128)
+    header++;
+  return header + len;
+}
+
 // as per http://docs.oasis-open.org/mqtt/mqtt/v3.1.1/os/mqtt-v3.1.1-os.html#_Toc398718040
+// Returns 0 without touching packet if it won't fit in MAXBUFFERSIZE.
 uint16_t Adafruit_MQTT::publishPacket(uint8_t *packet, const char *topic,
                                      uint8_t *data, uint16_t bLen, uint8_t qos) {
   uint8_t *p = packet;
   uint16_t len=0;
 
+  if (publishPacketLen(topic, bLen, qos) > MAXBUFFERSIZE) {
+    ERROR_PRINTLN(F("Publish packet too big for the buffer"));
+    return 0;
+  }
+
   // calc length of non-header data
   len += 2;               // two bytes to set the topic size
   len += strlen(topic); // topic length
@@ -774,6 +1343,15 @@ Adafruit_MQTT_Publish::Adafruit_MQTT_Publish(Adafruit_MQTT *mqttserver,
   mqtt = mqttserver;
   topic = feed;
   qos = q;
+  mqtt->addPublishTopic(topic);
+}
+
+void Adafruit_MQTT_Publish::setLatestValue(bool latest) {
+  mqtt->addPublishTopic(topic, latest);
+}
+
+bool Adafruit_MQTT_Publish::setRateLimit(uint16_t per_minute, uint8_t burst) {
+  return mqtt->setPublishRateLimit(topic, per_minute, burst);
 }
 
 bool Adafruit_MQTT_Publish::publish(int i) {
@@ -823,7 +1401,15 @@ Adafruit_MQTT_Subscribe::Adafruit_MQTT_Subscribe(Adafruit_MQTT *mqttserver,
   callback_buffer = 0;
   callback_double = 0;
   callback_io = 0;
+  callback_view = 0;
+  callback_binary = 0;
+  binary_decoder = 0;
   io_feed = 0;
+  payload_view.data = lastread;
+  payload_view.len = 0;
+  is_retained = false;
+  fetch_last = false;
+  fetch_pending = false;
 }
 
 void Adafruit_MQTT_Subscribe::setCallback(SubscribeCallbackUInt32Type cb) {
@@ -843,10 +1429,17 @@ void Adafruit_MQTT_Subscribe::setCallback(AdafruitIO_Feed *f, SubscribeCallbackI
   io_feed = f;
 }
 
+void Adafruit_MQTT_Subscribe::setCallback(SubscribeCallbackViewType cb) {
+  callback_view = cb;
+}
+
 void Adafruit_MQTT_Subscribe::removeCallback(void) {
   callback_uint32t = 0;
   callback_buffer = 0;
   callback_double = 0;
   callback_io = 0;
+  callback_view = 0;
+  callback_binary = 0;
+  binary_decoder = 0;
   io_feed = 0;
 }
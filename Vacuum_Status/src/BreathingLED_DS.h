@@ -0,0 +1,83 @@
+#ifndef _BREATHINGLED_DS_
+#define _BREATHINGLED_DS_
+
+#include <math.h>
+
+const int BREATHE_STEPS = 64;   //points in one breath
+
+//Breathes an LED on a PWM pin from a software timer
+//  The sine is worked out once into a table, so each step is a lookup, and
+//  analogWrite() only runs when the level actually changes.
+class BreathingLED {
+    int _pin;
+    uint8_t _table[BREATHE_STEPS];
+    volatile uint8_t _step;
+    volatile int _lastLevel;
+    volatile bool _isOn;
+    Timer _timer;
+
+    //Runs in the timer thread
+    void tick(){
+        SINGLE_THREADED_BLOCK(){
+            if(!_isOn){
+                return;
+            }
+            int level = _table[_step];
+            _step = (_step + 1) % BREATHE_STEPS;
+            if(level != _lastLevel){
+                analogWrite(_pin, level);
+                _lastLevel = level;
+            }
+        }
+    }
+
+    public:
+
+        //Breathe between minLevel and maxLevel (0-255) once every periodMs
+        BreathingLED(int pin, int minLevel, int maxLevel, int periodMs):
+            _timer(periodMs / BREATHE_STEPS, &BreathingLED::tick, *this)
+        {
+            float mid = (maxLevel + minLevel) / 2.0;
+            float amplitude = (maxLevel - minLevel) / 2.0;
+
+            _pin = pin;
+            _step = 0;
+            _lastLevel = -1;
+            _isOn = false;
+            for(int i=0; i<BREATHE_STEPS; i++){
+                _table[i] = amplitude * sin(2 * M_PI * i / BREATHE_STEPS) + mid;
+            }
+        }
+
+        //Level for step i of a breath
+        int level(int i){
+            return _table[i % BREATHE_STEPS];
+        }
+
+        void start(){
+            if(_isOn){
+                return;
+            }
+            _isOn = true;
+            _timer.start();
+        }
+
+        //Stop breathing and turn the LED off
+        void stop(){
+            if(!_isOn){
+                return;
+            }
+            _timer.stop();
+            SINGLE_THREADED_BLOCK(){
+                _isOn = false;
+                _lastLevel = -1;
+                digitalWrite(_pin, 0);
+            }
+        }
+
+        bool isOn(){
+            return _isOn;
+        }
+};
+
+#endif  //_BREATHINGLED_DS_
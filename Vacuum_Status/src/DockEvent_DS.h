@@ -0,0 +1,83 @@
+#ifndef _DOCKEVENT_H_
+#define _DOCKEVENT_H_
+
+//Dock event sent from Vacuum_Status to Vacuum_ATM on the vacuumevents feed
+//  Text, so Adafruit IO stores and shows it like any other value: "state,seq,timeMs",
+//  e.g. "1,42,1760870400123". 26 characters at most, which the outbox holds.
+const int DOCK_EVENT_MAX_LEN = 26;
+
+struct DockEvent{
+    uint8_t state;      //1 = on the charger, 0 = off
+    uint32_t seq;       //counts up by one for every event, never repeats
+    uint64_t timeMs;    //when it happened on Vacuum_Status, ms since 1970
+};
+
+//Writes the event into buf, which needs DOCK_EVENT_MAX_LEN + 1 bytes, returns its length
+//  printf can't be trusted with 64 bit numbers on the Photon, so the time is done by hand.
+inline int packDockEvent(const DockEvent &event, char *buf){
+    char digits[20];
+    int count = 0;
+    uint64_t timeMs = event.timeMs;
+
+    do{
+        digits[count++] = '0' + timeMs % 10;
+        timeMs = timeMs / 10;
+    } while(timeMs > 0);
+    int len = snprintf(buf, DOCK_EVENT_MAX_LEN + 1, "%u,%lu,", (unsigned int)event.state, (unsigned long)event.seq);
+    while(count > 0 && len < DOCK_EVENT_MAX_LEN){
+        buf[len++] = digits[--count];
+    }
+    buf[len] = 0;
+    return len;
+}
+
+//Returns false if the payload isn't a dock event
+inline bool unpackDockEvent(const uint8_t *buf, int len, DockEvent *event){
+    uint64_t fields[3] = {0, 0, 0};
+    int field = 0;
+    int digits = 0;
+
+    if(len > DOCK_EVENT_MAX_LEN){
+        return false;
+    }
+    for(int i=0; i<len; i++){
+        if(buf[i] == ',' && digits > 0 && field < 2){
+            field++;
+            digits = 0;
+        } else if(buf[i] >= '0' && buf[i] <= '9' && digits < 19){
+            fields[field] = fields[field] * 10 + (buf[i] - '0');
+            digits++;
+        } else{
+            return false;
+        }
+    }
+    if(field != 2 || digits == 0 || fields[0] > 1 || fields[1] > 0xFFFFFFFF){
+        return false;
+    }
+    event->state = fields[0];
+    event->seq = fields[1];
+    event->timeMs = fields[2];
+    return true;
+}
+
+//Wall clock time in ms, 0 until the cloud has set the time
+//  Time.now() only has whole seconds, so this is millis() pinned to it. Two readings
+//  are exactly millis() apart unless the cloud moved the clock by more than 2 s in between.
+inline uint64_t epochMillis(){
+    static uint64_t offset;
+    static bool isSet = false;
+
+    if(!Time.isValid()){
+        return 0;
+    }
+    uint64_t clockMs = (uint64_t)Time.now() * 1000;
+    uint64_t ms = offset + millis();
+    if(!isSet || ms + 2000 < clockMs || ms > clockMs + 2000){
+        offset = clockMs - millis();   //first call, time sync or millis() rollover
+        isSet = true;
+        ms = offset + millis();
+    }
+    return ms;
+}
+
+#endif // _DOCKEVENT_H_
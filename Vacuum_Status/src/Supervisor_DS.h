@@ -0,0 +1,147 @@
+#ifndef _SUPERVISOR_DS_
+#define _SUPERVISOR_DS_
+
+const int SUPERVISOR_MAX_TASKS = 6;
+const int SUPERVISOR_CHECK_TIME = 1000;     //how often the timer looks at the tasks
+
+struct SupervisedTask{
+    const char *name;
+    unsigned int deadline;          //ms allowed between heartbeats
+    volatile unsigned int lastBeat;
+    volatile bool isLate;
+    unsigned long misses;
+};
+
+//Feeds the hardware watchdog only while every task is keeping up
+//  Each part of the firmware calls beat() when it has done its work. A timer checks the
+//  tasks every second, so this still runs while loop() is stuck. Once a task is past its
+//  deadline the culprit is handed to onMiss(), kept for takeMiss(), and the watchdog is
+//  left to run out. The culprit is the task that beat longest ago - the others are waiting
+//  behind it. Until the first task is added nothing vouches for the firmware, so the
+//  watchdog isn't fed at all - add the tasks before anything that can block.
+class Supervisor {
+    SupervisedTask _tasks[SUPERVISOR_MAX_TASKS];
+    int _count;
+    void (*_onMiss)(const char *name, unsigned int lateMs);
+    volatile int _missTask;         //culprit of the last miss takeMiss() hasn't seen, -1 if none
+    volatile unsigned int _missLateMs;
+    Timer _timer;
+
+    //Runs in the timer thread
+    void check(){
+        unsigned int now = millis();
+        int culprit = -1;
+        bool isHealthy = true;
+        bool isNewMiss = false;
+
+        if(_count == 0){
+            return;
+        }
+        for(int i=0; i<_count; i++){
+            SupervisedTask &task = _tasks[i];
+            if(culprit < 0 || now - task.lastBeat > now - _tasks[culprit].lastBeat){
+                culprit = i;
+            }
+            if(now - task.lastBeat <= task.deadline){
+                continue;
+            }
+            isHealthy = false;
+            if(!task.isLate){
+                task.isLate = true;
+                task.misses++;
+                isNewMiss = true;
+            }
+        }
+        if(isHealthy){
+            Watchdog.refresh();
+            return;
+        }
+        if(isNewMiss){
+            unsigned int lateMs = now - _tasks[culprit].lastBeat;
+            _missLateMs = lateMs;
+            _missTask = culprit;
+            if(_onMiss){
+                _onMiss(_tasks[culprit].name, lateMs);
+            }
+        }
+    }
+
+    public:
+
+        Supervisor():
+            _timer(SUPERVISOR_CHECK_TIME, &Supervisor::check, *this)
+        {
+            _count = 0;
+            _onMiss = NULL;
+            _missTask = -1;
+            _missLateMs = 0;
+        }
+
+        //Start checking, call right after Watchdog.start()
+        void begin(){
+            _timer.start();
+        }
+
+        //Returns the task number for beat(), -1 if there's no room
+        int add(const char *name, unsigned int deadlineMs){
+            if(_count >= SUPERVISOR_MAX_TASKS){
+                return -1;
+            }
+            SupervisedTask &task = _tasks[_count];
+            task.name = name;
+            task.deadline = deadlineMs;
+            task.lastBeat = millis();
+            task.isLate = false;
+            task.misses = 0;
+            return _count++;
+        }
+
+        void beat(int task){
+            if(task < 0 || task >= _count){
+                return;
+            }
+            _tasks[task].lastBeat = millis();
+            _tasks[task].isLate = false;
+        }
+
+        void beatAll(){
+            for(int i=0; i<_count; i++){
+                beat(i);
+            }
+        }
+
+        //Stop checking before sleep, nothing beats while we're asleep
+        void pause(){
+            _timer.stop();
+        }
+
+        //After waking, everything starts its deadline over
+        void resume(){
+            beatAll();
+            _timer.start();
+        }
+
+        //Called from the timer thread with the culprit, keep it short
+        void onMiss(void (*callback)(const char *name, unsigned int lateMs)){
+            _onMiss = callback;
+        }
+
+        //The last miss, once, for loop() to log - the timer thread can't print
+        bool takeMiss(const char **name, unsigned int *lateMs){
+            int task = _missTask;
+
+            if(task < 0){
+                return false;
+            }
+            _missTask = -1;
+            *name = _tasks[task].name;
+            *lateMs = _missLateMs;
+            return true;
+        }
+
+        unsigned long misses(int task){
+            return _tasks[task].misses;
+        }
+};
+
+#endif  //_SUPERVISOR_DS_
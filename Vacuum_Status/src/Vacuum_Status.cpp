@@ -7,90 +7,180 @@
 #include "Particle.h"
 #include "credentials.h"
 #include "Button_DS.h"
+#include "DockEvent_DS.h"
+#include "BreathingLED_DS.h"
+#include "RetainedBlock_DS.h"
+#include "Supervisor_DS.h"
+#include "DeferredLog_DS.h"
 #include "neopixel.h"
 #include <Adafruit_MQTT.h>
 #include "Adafruit_MQTT/Adafruit_MQTT_SPARK.h"
 #include "Adafruit_MQTT/Adafruit_MQTT.h"
-#include <math.h>
 
 
 SYSTEM_MODE(AUTOMATIC);
 SYSTEM_THREAD(ENABLED);
+STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY));
 
 const int RED_LED_PIN = D1;
+const int DOCK_SEQ_ADDRESS = 0x0010;  //4 bytes, sequence number of the last dock event
+const int OUTBOX_ADDRESS = 0x0100;  //dock changes waiting for MQTT to come back
+const int AIO_PUBLISH_PER_MIN = 10;   //Adafruit IO allows 30/min per account, Vacuum_ATM gets the rest
+const int AIO_PUBLISH_BURST = 4;
+const int DIAG_PUBLISH_TIME = 900000; //MQTT health summary every 15 min
+const bool SLEEP_ENABLED = true;      //sleep between dock changes
+const int SLEEP_MAX_TIME = 300000;    //wake every 5 min anyway, well inside the watchdog
+const int AWAKE_MIN_TIME = 15000;     //stay up after waking so the cloud and Adafruit IO can talk to us
+const int AWAKE_MAX_TIME = 60000;     //sleep even if MQTT can't send, the outbox keeps it in EEPROM
+const int NETWORK_DEADLINE = 120000;  //heartbeat deadlines - connecting can take a while, the rest wait behind it
+const int DOCK_DEADLINE = 150000;
+const int LEDS_DEADLINE = 150000;
 
 bool isVacCharging;
 bool lastVacState;
-unsigned int stateChangeUnixTime;
-String pubInfoString;
-float t;
-float ledBrightness;
+DockEvent dockEvent;
+char mqttDiagnostics[96];  //also readable as the mqttStats cloud variable
+unsigned int wakeTime = 0;        //millis() when we last woke up
+bool isWakePublishPending = false;
+int wakeLatency = -1;             //ms from a dock change waking us to its event leaving, -1 until measured
+
+//Which task stopped the watchdog being fed, kept through the reset that follows
+struct HangRecord{
+    char task[16];
+    uint32_t lateMs;
+    uint32_t time;
+};
+retained RetainedBlock<HangRecord> lastHang;
+char lastHangText[48];     //the lastHang cloud variable
+int networkTask, dockTask, ledsTask;
 
 //Functions
 void MQTT_connect();
 void adaPublish();
 bool MQTT_ping();
+void checkAdafruitIO();
+void publishDiagnostics();
+void measureWakeLatency();
+void sleepWhenIdle();
+void recordHang(const char *task, unsigned int lateMs);
 
 TCPClient TheClient;
 Adafruit_MQTT_SPARK mqtt(&TheClient, AIO_SERVER, AIO_SERVERPORT, AIO_USERNAME, AIO_KEY);
 Adafruit_MQTT_Publish vacStatus = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/vacuumstatus");
+Adafruit_MQTT_Publish vacEvents = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/vacuumevents");
+static_assert(DOCK_EVENT_MAX_LEN <= MQTT_OUTBOX_PAYLOADLEN, "a dock event has to fit an outbox slot");
+Adafruit_MQTT_Publish diagPub = Adafruit_MQTT_Publish(&mqtt, AIO_USERNAME "/feeds/diagnostics.vacuumstatus");
+Adafruit_MQTT_Subscribe throttleSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/throttle");
+Adafruit_MQTT_Subscribe errorsSub = Adafruit_MQTT_Subscribe(&mqtt, AIO_USERNAME "/errors");
 
 
 Button vacButton(A2);
+BreathingLED redLED(RED_LED_PIN, 5, 51, 4000);     //same 4 s breath as before
+Supervisor supervisor;
+DeferredLog trace;      //everything printed goes through here, decode it with Tools/TraceDecode
 
 void noUglyLEDs();
 void lightRedLED();
 
 void setup() {
     Serial.begin(9600);
-    waitFor(Serial.isConnected, 10000);
+    trace.begin();      //holds the log until something connects, no need to wait for it
 
     pinMode(RED_LED_PIN, OUTPUT);
     pinMode(D7, OUTPUT);
     digitalWrite(D7, LOW);
 
-    Watchdog.init(WatchdogConfiguration().timeout(600s));   //Set watchdog timer to 5 min
+    Watchdog.init(WatchdogConfiguration().timeout(360s));   //longest sleep and a minute, only fed while every task keeps up
     Watchdog.start();
+    //tasks go in first, the watchdog isn't fed until something is beating
+    networkTask = supervisor.add("network", NETWORK_DEADLINE);
+    dockTask = supervisor.add("dock", DOCK_DEADLINE);
+    ledsTask = supervisor.add("leds", LEDS_DEADLINE);
+    supervisor.onMiss(recordHang);
+    supervisor.begin();
+    if(lastHang.isValid()){
+        snprintf(lastHangText, sizeof(lastHangText), "%s, %lus late at %lu", lastHang.data.task,
+            (unsigned long)(lastHang.data.lateMs / 1000), (unsigned long)lastHang.data.time);
+        trace.printf("Last hang: %s\n\n", lastHangText);
+    }
+
+    EEPROM.get(DOCK_SEQ_ADDRESS, dockEvent.seq);
+    if(dockEvent.seq == 0xFFFFFFFF){     //blank EEPROM
+        dockEvent.seq = 0;
+    }
+
+    mqtt.setOutboxStorage(OUTBOX_ADDRESS);    //every dock change matters, keep them through resets
+    mqtt.setRateLimit(AIO_PUBLISH_PER_MIN, AIO_PUBLISH_BURST);
+    mqtt.watchThrottle(&throttleSub, &errorsSub);
+    vacStatus.setLatestValue(true);   //the dashboard only needs the current state, only dock events queue up
+    diagPub.setLatestValue(true);
+    Particle.variable("mqttStats", mqttDiagnostics);
+    Particle.variable("wakeLatency", wakeLatency);
+    Particle.variable("lastHang", lastHangText);
+#ifdef LAN_MQTT_SERVER
+    //Prefer the broker on the LAN so the ATM hears about the dock right away
+    mqtt.addBroker(LAN_MQTT_SERVER, LAN_MQTT_PORT, LAN_MQTT_USERNAME, LAN_MQTT_KEY, true);
+#endif
 }
 
 void loop() {
-    Watchdog.refresh();     //Watchdog timer checks in every loop
+    const char *missedTask;
+    unsigned int missedMs;
+
+    if(supervisor.takeMiss(&missedTask, &missedMs)){
+        trace.printf("### %s missed its heartbeat, %ums since the last one ###\n", missedTask, missedMs);
+    }
     MQTT_connect();
     MQTT_ping();
+    checkAdafruitIO();
+    publishDiagnostics();
+    supervisor.beat(networkTask);
     isVacCharging = vacButton.isPressed();
 
     lightRedLED();
     
     if(isVacCharging != lastVacState){
-        Serial.printf("Status changed! Send to adafruit!\nCharging: %i\nCurrent Time: %u\n\n", isVacCharging, stateChangeUnixTime);
         lastVacState = isVacCharging;
 
-        // I was planning to send vacuum status and time together, but changed my mind
-        // 
-        // stateChangeUnixTime = Time.now();
-        // pubInfoString = String(isVacCharging)+String(stateChangeUnixTime);      //Add current vacuum state onto beginning of string
-        // Serial.printf("%s\n\n", pubInfoString.c_str());
+        //Stamp the change here so the ATM times the vacuum by when it happened, not when it arrived
+        dockEvent.state = isVacCharging;
+        dockEvent.seq++;
+        dockEvent.timeMs = epochMillis();
+        EEPROM.put(DOCK_SEQ_ADDRESS, dockEvent.seq);
+        trace.printf("Status changed! Send to adafruit!\nCharging: %i\nEvent #%lu at %lu.%03lu\n\n", isVacCharging,
+            dockEvent.seq, (unsigned long)(dockEvent.timeMs / 1000), (unsigned long)(dockEvent.timeMs % 1000));
 
         adaPublish();       //send state to adafruit 
     }
+    supervisor.beat(dockTask);
 
+    measureWakeLatency();
     noUglyLEDs();  
+    supervisor.beat(ledsTask);
+    sleepWhenIdle();
 }
 
 //Pulse red LED when vacuum is charging
+//  redLED steps itself from a timer, this only starts and stops it
 void lightRedLED(){
     if(isVacCharging){
-        t = fmod((millis()/1000.0 + 0.5), 4.0) ;         //Keeps T between 0.0-4.0 to make calculation easier.
-        ledBrightness = 23 * sin(2*M_PI*t/4.0)+28;
-        analogWrite(RED_LED_PIN, ledBrightness);
+        redLED.start();
     }else{
-        digitalWrite(RED_LED_PIN, 0);
+        redLED.stop();
     }
 }
 
 //turn off other onboard LEDs
+//  Only touch RGB when that changes, not every pass
 void noUglyLEDs(){
-    if((millis()>20000)&&(Particle.connected)){
+    static int isRGBDark = -1;
+    bool makeDark = (millis()>20000)&&(Particle.connected());
+
+    if(makeDark == isRGBDark){
+        return;
+    }
+    isRGBDark = makeDark;
+    if(makeDark){
         RGB.control(true);
         RGB.brightness(0);
     } else{
@@ -98,11 +188,124 @@ void noUglyLEDs(){
     }
 }
 
-//Publish to Adafruit.io
+//Sleep until the dock changes. Wi-Fi is off while we sleep, so MQTT is closed first
+//  and comes back on the cached broker address after waking.
+void sleepWhenIdle(){
+    SystemSleepConfiguration config;
+
+    if(!SLEEP_ENABLED || millis() - wakeTime < AWAKE_MIN_TIME){
+        return;
+    }
+    if(vacButton.isPressed() != lastVacState || System.updatesPending()){
+        return;
+    }
+    if(mqtt.outboxDepth() > 0 && millis() - wakeTime < AWAKE_MAX_TIME){
+        return;     //give the dock event a chance to go out first
+    }
+
+    if(mqtt.connected()){
+        mqtt.disconnect();
+    }
+    mqtt.saveOutbox();      //a reset while asleep mustn't lose the dock event
+    //PWM stops with the CPU, hold the LED on so it still shows charging
+    if(isVacCharging){
+        redLED.stop();
+        digitalWrite(RED_LED_PIN, HIGH);
+    }
+    trace.printf("Sleeping, %i queued\n", mqtt.outboxDepth());
+
+    config.mode(SystemSleepMode::STOP)
+          .gpio(A2, CHANGE)
+          .duration(SLEEP_MAX_TIME);
+    supervisor.pause();
+    SystemSleepResult result = System.sleep(config);
+
+    wakeTime = millis();
+    Watchdog.refresh();
+    supervisor.resume();
+    if(result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO && vacButton.isPressed() != lastVacState){
+        isWakePublishPending = true;
+        trace.printf("Woke on dock change\n");
+    }
+    waitFor(WiFi.ready, 10000);     //MQTT doesn't need the Particle cloud, go as soon as Wi-Fi is up
+}
+
+//Supervisor caught a task missing its heartbeat, the watchdog will reset us soon
+//  Runs in the timer thread, only touches retained RAM.
+void recordHang(const char *task, unsigned int lateMs){
+    strncpy(lastHang.data.task, task, sizeof(lastHang.data.task) - 1);
+    lastHang.data.task[sizeof(lastHang.data.task) - 1] = 0;
+    lastHang.data.lateMs = lateMs;
+    lastHang.data.time = Time.now();
+    lastHang.seal();
+}
+
+//Time from waking on a dock change to its event leaving for the broker
+void measureWakeLatency(){
+    if(!isWakePublishPending || !mqtt.connected() || mqtt.outboxDepth() > 0){
+        return;
+    }
+    isWakePublishPending = false;
+    wakeLatency = millis() - wakeTime;
+    trace.printf("Wake to publish: %ims\n", wakeLatency);
+}
+
+//Publish to Adafruit.io - plain state for the dashboard, timestamped event for the ATM
+//  If MQTT is down these go into the outbox and are sent after reconnecting
 void adaPublish(){
-  if(mqtt.Update()){
-    vacStatus.publish(isVacCharging);
+  char eventText[DOCK_EVENT_MAX_LEN + 1];
+
+  packDockEvent(dockEvent, eventText);
+  if(!vacEvents.publish(eventText)){
+    trace.printf("Event deferred: %i queued, %i%% of rate limit used\n", mqtt.outboxDepth(), mqtt.rateLimitUsage());
   }
+  if(!vacStatus.publish(isVacCharging)){
+    trace.printf("Publish deferred: %i queued, %i%% of rate limit used\n", mqtt.outboxDepth(), mqtt.rateLimitUsage());
+  }
+}
+
+//Listen for Adafruit IO throttle/error notices and send anything held back
+void checkAdafruitIO(){
+    Adafruit_MQTT_Subscribe *subscription;
+
+    while((subscription = mqtt.readSubscription(0))){
+        if(subscription == &throttleSub || subscription == &errorsSub){
+            //notices are longer than lastread, print them from the packet buffer
+            char notice[TRACE_MAX_STRING + 1];
+            int len = min((int)subscription->payload().len, TRACE_MAX_STRING);
+            memcpy(notice, subscription->payload().data, len);
+            notice[len] = 0;
+            trace.printf("Adafruit IO: %s\n\n", notice);
+        }
+    }
+    mqtt.flushOutbox();
+}
+
+//Summarize MQTT health for the diagnostics feed and the mqttStats cloud variable
+void publishDiagnostics(){
+    static unsigned int lastDiagTime;
+    Adafruit_MQTT_Metrics stats;
+    unsigned long packetsIn = 0;
+    unsigned long packetsOut = 0;
+
+    if(millis()-lastDiagTime < DIAG_PUBLISH_TIME){
+        return;
+    }
+    lastDiagTime = millis();
+
+    mqtt.metrics(&stats);
+    for(int i=0; i<16; i++){
+        packetsIn = packetsIn + stats.packets_in[i];
+        packetsOut = packetsOut + stats.packets_out[i];
+    }
+    snprintf(mqttDiagnostics, sizeof(mqttDiagnostics), "rx %lu/%lu tx %lu/%lu drop %lu trunc %lu recon %lu ping %lu rtt %lu conn %lu",
+        packetsIn, stats.bytes_in, packetsOut, stats.bytes_out, stats.dropped, stats.truncated,
+        stats.reconnects, stats.reconnect_causes[MQTT_CAUSE_PING], mqtt.pingRTT(), stats.connect_ms.max);
+
+    //diagnostics can wait, don't spend rate limit the real data needs
+    if(mqtt.connected() && mqtt.rateLimitUsage() < 50){
+        diagPub.publish(mqttDiagnostics);
+    }
 }
 
 // Function to connect and reconnect as necessary to the MQTT server.
@@ -110,36 +313,30 @@ void adaPublish(){
 void MQTT_connect(){
     int8_t ret;
 
-    // Return if already connected.
-    if (mqtt.connected()){
+    // Return if already connected, or if Wi-Fi is still coming back after sleep.
+    if (mqtt.connected() || !WiFi.ready()){
         return;
     }
 
-
-    Serial.print("Connecting to MQTT... ");
+    trace.printf("Connecting to MQTT... ");
 
     while((ret = mqtt.connect()) != 0){
-        Serial.printf("Error Code %s\n", mqtt.connectErrorString(ret));
-        Serial.printf("Retrying MQTT connection in 5 seconds...\n");
+        trace.printf("Error Code %s\n", mqtt.connectErrorString(ret));
+        trace.printf("Retrying MQTT connection in 5 seconds...\n");
         mqtt.disconnect();
         delay(5000);
     }
-    Serial.printf("MQTT Connected!\n");
+    trace.printf("MQTT Connected to %s! DNS: %lums, TCP: %lums, CONNACK: %lums\n", mqtt.brokerName(),
+        mqtt.connectTiming().dns_ms, mqtt.connectTiming().tcp_ms, mqtt.connectTiming().connack_ms);
 }
 
 //Keeps the connection open to Adafruit
+//  The library only pings once the link has been quiet for most of the keepalive,
+//  and doesn't wait for the reply. A ping that never gets answered drops the connection.
 bool MQTT_ping() {
-    static unsigned int last;
-    bool pingStatus;
-
-    if ((millis()-last)>120000) {
-        Serial.printf("Pinging MQTT \n");
-        pingStatus = mqtt.ping();
-        if(!pingStatus) {
-        Serial.printf("Disconnecting \n");
-        mqtt.disconnect();
-        }
-        last = millis();
+    if(!mqtt.keepalive()){
+        trace.printf("MQTT keepalive failed, reconnecting\n");
+        return false;
     }
-    return pingStatus;
+    return true;
 }
\ No newline at end of file